@@ -175,6 +175,107 @@ void heavyhitter_hit() {
 	}
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+// failure injection
+
+struct m61_failconfig failcfg;
+int failcfg_installed = 0;              // 0 until configured (explicitly or from M61_FAIL)
+char failcfg_file[200];
+unsigned long long fail_attempts = 0;   // allocation attempts seen since configuration
+uint64_t fail_random_state;
+
+// deterministic random number in [0, 1) drawn from the configured seed (splitmix64)
+static double fail_random(void) {
+	uint64_t z = (fail_random_state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// m61_setfailconfig(cfg)
+///    Install failure-injection rules `*cfg`, or disable injection if
+///    `cfg == NULL`.
+
+void m61_setfailconfig(const struct m61_failconfig* cfg) {
+	memset(&failcfg, 0, sizeof(failcfg));
+	if (cfg) {
+		failcfg = *cfg;
+		if (cfg->fail_file) {
+			strncpy(failcfg_file, cfg->fail_file, sizeof(failcfg_file) - 1);
+			failcfg_file[sizeof(failcfg_file) - 1] = 0;
+			failcfg.fail_file = failcfg_file;
+		}
+	}
+	failcfg_installed = 1;
+	fail_attempts = 0;
+	fail_random_state = failcfg.seed;
+}
+
+// reads rules from M61_FAIL, a comma-separated list of key=value pairs
+// (nth, every, p, seed, budget, site=FILE[:LINE]); unknown keys are ignored
+static void failcfg_fromenv(void) {
+	struct m61_failconfig cfg;
+	char site[200];
+	memset(&cfg, 0, sizeof(cfg));
+	const char* s = getenv("M61_FAIL");
+	while (s && *s) {
+		const char* eq = strchr(s, '=');
+		const char* comma = strchr(s, ',');
+		if (!comma)
+			comma = s + strlen(s);
+		if (eq && eq < comma) {
+			size_t klen = eq - s;
+			const char* v = eq + 1;
+			if (klen == 3 && !strncmp(s, "nth", 3))
+				cfg.fail_nth = strtoull(v, NULL, 0);
+			else if (klen == 5 && !strncmp(s, "every", 5))
+				cfg.fail_every = strtoull(v, NULL, 0);
+			else if (klen == 1 && s[0] == 'p')
+				cfg.fail_probability = strtod(v, NULL);
+			else if (klen == 4 && !strncmp(s, "seed", 4))
+				cfg.seed = strtoull(v, NULL, 0);
+			else if (klen == 6 && !strncmp(s, "budget", 6))
+				cfg.budget = strtoull(v, NULL, 0);
+			else if (klen == 4 && !strncmp(s, "site", 4)
+				 && (size_t) (comma - v) < sizeof(site)) {
+				memcpy(site, v, comma - v);
+				site[comma - v] = 0;
+				char* colon = strrchr(site, ':');
+				if (colon) {
+					*colon = 0;
+					cfg.fail_line = atoi(colon + 1);
+				}
+				cfg.fail_file = site;
+			}
+		}
+		s = *comma ? comma + 1 : comma;
+	}
+	m61_setfailconfig(&cfg);
+}
+
+// decides whether the allocation of `sz` bytes at `file`:`line` should fail;
+// every attempt advances the attempt counter and (if enabled) the random state
+static int fail_check(size_t sz, const char* file, int line) {
+	if (!failcfg_installed)
+		failcfg_fromenv();
+	unsigned long long n = ++fail_attempts;
+	int fail = 0;
+	if (failcfg.fail_nth && n == failcfg.fail_nth)
+		fail = 1;
+	if (failcfg.fail_every && n % failcfg.fail_every == 0)
+		fail = 1;
+	if (failcfg.fail_probability > 0 && fail_random() < failcfg.fail_probability)
+		fail = 1;
+	if (failcfg.budget
+	    && (sz > failcfg.budget || mstat.active_size > failcfg.budget - sz))
+		fail = 1;
+	if (failcfg.fail_file && !strcmp(file, failcfg.fail_file)
+	    && (!failcfg.fail_line || line == failcfg.fail_line))
+		fail = 1;
+	return fail;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 
 // memset(mstat, 0, sizeof(mstat));
@@ -190,6 +291,11 @@ void* m61_malloc(size_t sz, const char* file, int line) {
 //    (void) file, (void) line;   // avoid uninitialized variable warnings
     
     char* p;
+    if (fail_check(sz, file, line)) {
+	mstat.nfail++;
+	mstat.fail_size += sz;
+	return NULL;
+    }
     if (sz < ((size_t) -1) - 2 * extrabyte) {
 	p = base_malloc(sz + extrabyte);
 	memset (p + sz, 8, extrabyte);
@@ -281,6 +387,8 @@ void* m61_realloc(void* ptr, size_t sz, const char* file, int line) {
     void* new_ptr = NULL;
     if (sz) {
         new_ptr = m61_malloc(sz, file, line);
+        if (!new_ptr)   // failed: the old block must stay valid
+            return NULL;
     }
     if (ptr && new_ptr) {
 	int i;
@@ -51,6 +51,29 @@ void m61_printstatistics(void);
 void m61_printleakreport(void);
 
 
+/// m61_failconfig
+///    Structure describing which allocations m61 should fail on purpose.
+///    Every enabled rule is checked; an allocation fails if any rule fires.
+///    All decisions depend only on the configuration and the sequence of
+///    allocation requests, so a run can be replayed exactly.
+struct m61_failconfig {
+    unsigned long long fail_nth;        // fail the Nth attempt (1-based); 0 = off
+    unsigned long long fail_every;      // fail every Nth attempt; 0 = off
+    double fail_probability;            // fail with this probability; 0 = off
+    unsigned long long seed;            // seed for `fail_probability`
+    unsigned long long budget;          // fail if active bytes would exceed this; 0 = off
+    const char* fail_file;              // fail allocations from this file; NULL = off
+    int fail_line;                      // ...at this line (0 = any line)
+};
+
+/// m61_setfailconfig(cfg)
+///    Install failure-injection rules `*cfg`, or disable injection if
+///    `cfg == NULL`. Resets the attempt counter and random state. If never
+///    called, rules are read from the `M61_FAIL` environment variable,
+///    e.g. `M61_FAIL=nth=10,every=3,p=0.01,seed=7,budget=1048576,site=a.c:12`.
+void m61_setfailconfig(const struct m61_failconfig* cfg);
+
+
 #if !M61_DISABLE
 // Redefine the `malloc` family of calls to use our versions.
 #define malloc(sz)              m61_malloc((sz), __FILE__, __LINE__)
@@ -0,0 +1,42 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Failure injection: Nth attempt, every Nth attempt, and allocation site.
+
+int main() {
+    struct m61_failconfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.fail_nth = 2;
+    cfg.fail_every = 5;
+    m61_setfailconfig(&cfg);
+
+    void* ptrs[10];
+    for (int i = 0; i < 10; ++i) {
+        ptrs[i] = malloc(10);
+        printf("%d", ptrs[i] != NULL);
+    }
+    printf("\n");
+    for (int i = 0; i < 10; ++i) {
+        free(ptrs[i]);
+    }
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.fail_file = __FILE__;
+    cfg.fail_line = __LINE__ + 2;
+    m61_setfailconfig(&cfg);
+    char* p = malloc(20);
+    assert(p == NULL);
+    p = malloc(30);
+    assert(p != NULL);
+    char* q = realloc(p, 100000);
+    assert(q != NULL);
+    free(q);
+
+    m61_setfailconfig(NULL);
+    m61_printstatistics();
+}
+
+//! 1011011110
+//! malloc count: active          0   total          9   fail          4
+//! malloc size:  active          0   total     100100   fail         50
@@ -0,0 +1,49 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Failure injection: byte budget and seeded random failures are replayable.
+
+static unsigned long long run(unsigned long long seed) {
+    struct m61_failconfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.fail_probability = 0.25;
+    cfg.seed = seed;
+    m61_setfailconfig(&cfg);
+
+    unsigned long long pattern = 0;
+    for (int i = 0; i < 64; ++i) {
+        void* p = malloc(8);
+        if (!p) {
+            pattern |= 1ULL << i;
+        }
+        free(p);
+    }
+    return pattern;
+}
+
+int main() {
+    unsigned long long a = run(61), b = run(61), c = run(62);
+    assert(a == b);
+    assert(a != 0 && a != ~0ULL);
+    assert(a != c);
+
+    struct m61_failconfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.budget = 1000;
+    m61_setfailconfig(&cfg);
+    char* p = malloc(600);
+    assert(p != NULL);
+    char* q = malloc(600);
+    assert(q == NULL);
+    char* r = realloc(p, 1200);
+    assert(r == NULL);
+    free(p);
+    q = malloc(1000);
+    assert(q != NULL);
+    free(q);
+    m61_setfailconfig(NULL);
+    printf("OK\n");
+}
+
+//! OK
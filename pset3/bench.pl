@@ -0,0 +1,264 @@
+#! /usr/bin/perl -w
+
+# bench.pl
+#    This program sweeps the test programs named on its command line
+#    (`make bench` passes all of TESTS) over a grid of block sizes (-b),
+#    strides (-t) and input file sizes, running every point against
+#    io61, stdio-io61 and slow-io61 with a warm and a cold page cache.
+#    It reports the median time of each point with a 95% confidence
+#    interval, and writes all points to files/bench.csv and
+#    files/bench.json.
+#
+#    Environment variables shrink or change the grid:
+#      LIBS="io61 stdio slow"   CACHE="warm cold"   TRIALS=5
+#      BLOCKS="1 512 4096 65536"   STRIDES="2 1024 1048576"
+#      SIZES="1 20" (input sizes in MiB)   MAXTIME=20 (seconds per run)
+#    A run that takes longer than MAXTIME is killed, and its point is
+#    reported as a timeout.
+
+use Time::HiRes qw(gettimeofday);
+use POSIX;
+use JSON::PP;
+eval { require "syscall.ph" };
+
+sub envlist ($$) {
+    my($name, $default) = @_;
+    my($x) = exists($ENV{$name}) ? $ENV{$name} : $default;
+    return grep { $_ ne "" } split(/[\s,]+/, $x);
+}
+
+my(@LIBS) = envlist("LIBS", "io61 stdio slow");
+my(@CACHE) = envlist("CACHE", "warm cold");
+my(@BLOCKS) = envlist("BLOCKS", "1 512 4096 65536");
+my(@STRIDES) = envlist("STRIDES", "2 1024 1048576");
+my(@SIZES) = envlist("SIZES", "1 20");
+my($TRIALS) = exists($ENV{"TRIALS"}) ? int($ENV{"TRIALS"}) : 5;
+$TRIALS = 5 if $TRIALS <= 0;
+my($MAXTIME) = exists($ENV{"MAXTIME"}) ? $ENV{"MAXTIME"} + 0 : 20;
+$MAXTIME = 20 if $MAXTIME <= 0;
+my(%PREFIX) = ("io61" => "", "stdio" => "stdio-", "slow" => "slow-");
+
+# stdio runs first so io61 points can report a ratio as they finish
+@LIBS = sort { ($b eq "stdio") <=> ($a eq "stdio") } @LIBS;
+foreach my $lib (@LIBS) {
+    die "bench.pl: unknown library '$lib'\n" if !exists($PREFIX{$lib});
+}
+
+sub decache ($) {
+    my($fn) = @_;
+    if (defined(&{"SYS_fadvise64"}) && open(DECACHE, "<", $fn)) {
+        syscall &SYS_fadvise64, fileno(DECACHE), 0, -s DECACHE, 4;
+        close(DECACHE);
+    }
+}
+
+sub makefile ($$) {
+    my($filename, $size) = @_;
+    if (!-r $filename || !defined(-s $filename) || -s $filename != $size) {
+        while (!defined(-s $filename) || -s $filename < $size) {
+            system("cat /usr/share/dict/words >> $filename");
+        }
+        truncate($filename, $size);
+    }
+}
+
+# program_options(PROGRAM)
+#    Returns the option string PROGRAM passes to io61_parse_arguments,
+#    or undef if it parses its own arguments.
+sub program_options ($) {
+    my($prog) = @_;
+    open(SRC, "<", "$prog.c") or return undef;
+    my($src) = join("", <SRC>);
+    close(SRC);
+    return $src =~ m{io61_parse_arguments\(\s*argc,\s*argv,\s*"([^"]*)"\)}
+        ? $1 : undef;
+}
+
+# run_once(COMMAND, INPUTS, COLD)
+#    Runs COMMAND once and returns its time in seconds, or undef if it
+#    failed or ran longer than MAXTIME. The time is the one the program
+#    reports from io61_profile_end, which excludes process startup.
+sub run_once ($$$) {
+    my($command, $inputs, $cold) = @_;
+    unlink(glob("files/out*.txt"));
+    if ($cold) {
+        decache($_) foreach @$inputs;
+    }
+    my($before) = Time::HiRes::time();
+    my($pid) = fork();
+    die "bench.pl: fork: $!\n" if !defined($pid);
+    if ($pid == 0) {
+        setpgrp(0, 0);
+        open(STDERR, ">", "files/bench-stderr.txt") or die;
+        exec("/bin/sh", "-c", $command);
+        exit(1);
+    }
+    my($status);
+    while (waitpid($pid, WNOHANG) == 0) {
+        if (Time::HiRes::time() > $before + $MAXTIME) {
+            kill 9, -$pid;
+            waitpid($pid, 0);
+            return undef;
+        }
+        Time::HiRes::sleep(0.002);
+    }
+    $status = $?;
+    my($delta) = Time::HiRes::time() - $before;
+    return undef if $status != 0;
+    if (open(ERR, "<", "files/bench-stderr.txt")) {
+        my($err) = join("", <ERR>);
+        close(ERR);
+        $delta = $1 + 0 if $err =~ m<^\{"time":([-+.\deE]+)>m && $1 > 0;
+    }
+    return $delta;
+}
+
+# median_ci(TIMES)
+#    Returns the median of TIMES and the order statistics that bound a
+#    95% confidence interval for it (normal approximation to the
+#    binomial; with 5 trials that is the minimum and maximum).
+sub median_ci (@) {
+    my(@t) = sort { $a <=> $b } @_;
+    my($n) = scalar(@t);
+    my($median) = $n % 2 ? $t[$n >> 1] : ($t[$n / 2 - 1] + $t[$n / 2]) / 2;
+    my($lo) = POSIX::floor(($n - 1.96 * sqrt($n)) / 2);
+    my($hi) = POSIX::ceil(1 + ($n + 1.96 * sqrt($n)) / 2);
+    $lo = 1 if $lo < 1;
+    $hi = $n if $hi > $n;
+    return ($median, $t[$lo - 1], $t[$hi - 1]);
+}
+
+if (!@ARGV) {
+    print STDERR "Usage: perl bench.pl PROGRAM...\n";
+    exit(1);
+}
+if (!-d "files" && (-e "files" || !mkdir("files"))) {
+    print STDERR "*** Cannot run benchmarks because 'files' cannot be created.\n";
+    exit(1);
+}
+foreach my $mb (@SIZES) {
+    makefile("files/text${mb}meg.txt", $mb << 20);
+}
+
+my(@points, %stdio_median);
+$| = 1;
+
+foreach my $prog (@ARGV) {
+    my($opts) = program_options($prog);
+    if (!defined($opts)) {
+        print "$prog: skipped (does not take io61_parse_arguments options)\n";
+        next;
+    }
+    my(@blocks) = $opts =~ /b/ ? @BLOCKS : ("");
+    my(@strides) = $opts =~ /t/ ? @STRIDES : ("");
+
+    foreach my $mb (@SIZES) {
+        my($in) = "files/text${mb}meg.txt";
+        foreach my $block (@blocks) {
+            foreach my $stride (@strides) {
+                # build the argument list; multi-file programs get two files
+                my($args) = "";
+                $args .= " -b $block" if $block ne "";
+                $args .= " -t $stride" if $stride ne "";
+                my(@inputs) = ($in);
+                if ($opts =~ /#/ && $opts =~ /o/) {
+                    @inputs = ($in, $in);
+                    $args .= " -o files/out.txt $in $in";
+                } elsif ($opts =~ /#/) {
+                    $args .= " files/out1.txt files/out2.txt < $in";
+                } elsif ($opts =~ /o/) {
+                    $args .= " -o files/out.txt $in";
+                } else {
+                    $args .= " $in > files/out.txt";
+                }
+
+                foreach my $cache (@CACHE) {
+                    foreach my $lib (@LIBS) {
+                        my($command) = "./$PREFIX{$lib}$prog$args";
+                        my($key) = "$prog$args $cache";
+                        my($p) = {"program" => $prog, "lib" => $lib,
+                                  "cache" => $cache, "size" => $mb << 20,
+                                  "block" => $block eq "" ? undef : $block + 0,
+                                  "stride" => $stride eq "" ? undef : $stride + 0,
+                                  "command" => $command};
+                        printf "%-12s %-6s %-4s %s", $prog, $lib, $cache,
+                            "$PREFIX{$lib}$prog$args";
+
+                        my($ok) = $cache ne "warm"
+                            || defined(run_once($command, \@inputs, 0));
+                        my(@times);
+                        for (my $i = 0; $ok && $i < $TRIALS; ++$i) {
+                            my($t) = run_once($command, \@inputs, $cache eq "cold");
+                            last if !defined($t);
+                            push @times, $t;
+                        }
+                        if (@times < $TRIALS) {
+                            $p->{"timeout"} = JSON::PP::true;
+                            print "\n    timeout or error\n";
+                            push @points, $p;
+                            next;
+                        }
+
+                        @$p{"median", "ci_low", "ci_high"} = median_ci(@times);
+                        $p->{"trials"} = scalar(@times);
+                        $p->{"mb_per_sec"} = $mb / $p->{"median"};
+                        $stdio_median{$key} = $p->{"median"} if $lib eq "stdio";
+                        if ($lib ne "stdio" && exists($stdio_median{$key})) {
+                            $p->{"ratio"} = $stdio_median{$key} / $p->{"median"};
+                        }
+                        printf "\n    %.5fs [%.5fs, %.5fs] %.1f MB/s%s\n",
+                            $p->{"median"}, $p->{"ci_low"}, $p->{"ci_high"},
+                            $p->{"mb_per_sec"},
+                            exists($p->{"ratio"}) ? sprintf(", %.2fx stdio", $p->{"ratio"}) : "";
+                        push @points, $p;
+                    }
+                }
+            }
+        }
+    }
+}
+unlink("files/bench-stderr.txt");
+
+# flag cliffs: throughput at least halving when the block size or stride
+# grows by one grid step, all else equal
+my(%series);
+foreach my $p (grep { !exists($_->{"timeout"}) } @points) {
+    foreach my $axis ("block", "stride") {
+        next if !defined($p->{$axis});
+        my($other) = $axis eq "block" ? "stride" : "block";
+        my($key) = join(" ", $axis, map { defined($_) ? $_ : "" }
+                        @$p{"program", "lib", "cache", "size", $other});
+        push @{$series{$key}}, $p;
+    }
+}
+foreach my $key (sort keys %series) {
+    my($axis) = $key =~ /^(\S+)/;
+    my(@s) = sort { $a->{$axis} <=> $b->{$axis} } @{$series{$key}};
+    for (my $i = 1; $i < @s; ++$i) {
+        if ($s[$i]->{"mb_per_sec"} < $s[$i - 1]->{"mb_per_sec"} / 2) {
+            printf "CLIFF: %s %s %s: %s %s -> %s drops %.1f -> %.1f MB/s\n",
+                $s[$i]->{"program"}, $s[$i]->{"lib"}, $s[$i]->{"cache"},
+                $axis, $s[$i - 1]->{$axis}, $s[$i]->{$axis},
+                $s[$i - 1]->{"mb_per_sec"}, $s[$i]->{"mb_per_sec"};
+        }
+    }
+}
+
+my(@columns) = ("program", "lib", "cache", "size", "block", "stride",
+                "trials", "median", "ci_low", "ci_high", "mb_per_sec",
+                "ratio", "timeout", "command");
+open(CSV, ">", "files/bench.csv") or die "files/bench.csv: $!\n";
+print CSV join(",", @columns), "\n";
+foreach my $p (@points) {
+    print CSV join(",", map {
+        my($v) = defined($p->{$_}) ? $p->{$_} : "";
+        $v = 1 if $_ eq "timeout" && $v ne "";
+        $v =~ /[,"]/ ? "\"" . ($v =~ s/"/""/gr) . "\"" : $v;
+    } @columns), "\n";
+}
+close(CSV);
+
+open(JSON, ">", "files/bench.json") or die "files/bench.json: $!\n";
+print JSON JSON::PP->new->canonical->pretty->encode(\@points);
+close(JSON);
+print "Wrote ", scalar(@points), " points to files/bench.csv and files/bench.json\n";
@@ -1,24 +1,33 @@
 #include "io61.h"
 
-// Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+// Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [-z] [-D] [FILE]
 //    Copies the input FILE to standard output in blocks.
+//    With -z, copies each block with io61_copy instead. With -D, opens
+//    the files with IO61_DIRECT.
 //    Default BLOCKSIZE is 4096.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args = io61_parse_arguments(argc, argv, "b:o:");
+    io61_arguments args = io61_parse_arguments(argc, argv, "b:o:zD");
     size_t block_size = args.block_size ? args.block_size : 4096;
 
     // Allocate buffer, open files
     char* buf = (char*) malloc(block_size);
 
     io61_profile_begin();
-    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    int direct = args.direct ? IO61_DIRECT : 0;
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY | direct);
     io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+                                      O_WRONLY | O_CREAT | O_TRUNC | direct);
 
     // Copy file data
     while (1) {
+        if (args.zero_copy) {
+            if (io61_copy(outf, inf, block_size) <= 0) {
+                break;
+            }
+            continue;
+        }
         ssize_t amount = io61_read(inf, buf, block_size);
         if (amount <= 0) {
             break;
@@ -1,17 +1,24 @@
 #include "io61.h"
 
-// Usage: ./cat61 [-s SIZE] [-o OUTFILE] [FILE]
+// Usage: ./cat61 [-s SIZE] [-o OUTFILE] [-z] [-D] [FILE]
 //    Copies the input FILE to OUTFILE one character at a time.
+//    With -z, copies with io61_copy instead. With -D, opens the files
+//    with IO61_DIRECT.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args = io61_parse_arguments(argc, argv, "s:o:");
+    io61_arguments args = io61_parse_arguments(argc, argv, "s:o:zD");
 
     io61_profile_begin();
-    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    int direct = args.direct ? IO61_DIRECT : 0;
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY | direct);
     io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+                                      O_WRONLY | O_CREAT | O_TRUNC | direct);
 
+    if (args.zero_copy) {
+        io61_copy(outf, inf, args.input_size);
+        args.input_size = 0;
+    }
     while (args.input_size > 0) {
         int ch = io61_readc(inf);
         if (ch == EOF) {
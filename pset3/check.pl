@@ -74,6 +74,50 @@ sub makebinaryfile ($$) {
     $fileinfo{$filename} = [-M $filename, -C $filename, $size];
 }
 
+sub makesparsefile ($$) {
+    my($filename, $size) = @_;
+    if (!-r $filename || !defined(-s $filename) || -s $filename != $size) {
+        # 64KB of binary data every 1MB, with holes between
+        my($data) = "";
+        open(SH, "<", "/bin/sh") or die;
+        binmode(SH);
+        read(SH, $data, 65536);
+        close(SH);
+        open(SPARSE, ">", $filename) or die;
+        binmode(SPARSE);
+        for (my $pos = 0; $pos < $size; $pos += 1 << 20) {
+            seek(SPARSE, $pos + ($pos >> 20) % 3 * 4096 + 100, 0);
+            print SPARSE $data;
+        }
+        truncate(SPARSE, $size);
+        close(SPARSE);
+    }
+    $fileinfo{$filename} = [-M $filename, -C $filename, $size];
+}
+
+sub makesortedfile ($$$) {
+    my($filename, $size, $seed) = @_;
+    if (!-r $filename || !defined(-s $filename) || -s $filename != $size) {
+        # random dictionary words, one per line, sorted bytewise; a last
+        # line of tildes sorts after them all and pads the file to size
+        open(WORDS, "<", "/usr/share/dict/words") or die;
+        my(@words) = grep { /^[\x20-\x7d]+$/ } map { chomp; $_ } <WORDS>;
+        close(WORDS);
+        srand($seed);
+        my(@lines, $len);
+        for ($len = 0; 1; ) {
+            my($w) = $words[int(rand(@words))] . "\n";
+            last if $len + length($w) + 2 > $size;
+            push @lines, $w;
+            $len += length($w);
+        }
+        open(SORTED, ">", $filename) or die;
+        print SORTED sort(@lines), "~" x ($size - $len - 1), "\n";
+        close(SORTED);
+    }
+    $fileinfo{$filename} = [-M $filename, -C $filename, $size];
+}
+
 sub verify_file ($) {
     my($filename) = @_;
     if (exists($fileinfo{$filename})
@@ -82,6 +126,10 @@ sub verify_file ($) {
         truncate($filename, 0);
         if ($filename =~ /^binary/) {
             makebinaryfile($filename, $fileinfo{$filename}->[2]);
+        } elsif ($filename =~ /sparse/) {
+            makesparsefile($filename, $fileinfo{$filename}->[2]);
+        } elsif ($filename =~ /sorted.*-(\d+)\./) {
+            makesortedfile($filename, $fileinfo{$filename}->[2], $1);
         } else {
             makefile($filename, $fileinfo{$filename}->[2]);
         }
@@ -201,11 +249,12 @@ sub run_sh61 ($;%) {
         return $answer;
     }
 
-    $nb = POSIX::read(fileno(PR), $buf, 2000);
+    # the report may include io61's per-file counters; their totals come
+    # last, so they are the values kept
+    $buf = run_sh61_pipe("", fileno(PR));
     close(PR);
-    $buf = $nb > 0 ? substr($buf, 0, $nb) : "";
 
-    while ($buf =~ m,\"(.*?)\"\s*:\s*([\d.]+),g) {
+    while ($buf =~ m,\"([^\"]*)\"\s*:\s*([\d.]+),g) {
         $answer->{$1} = $2;
     }
     $answer->{"time"} = $delta if !defined($answer->{"time"});
@@ -567,6 +616,12 @@ sub run ($) {
                $tt->{"time"}, $tt->{"utime"}, $tt->{"stime"}, $tt->{"maxrss"},
                $tt->{"medianof"}, $tt->{"medianof"} == 1 ? "" : "s");
             push @runtimes, $tt->{"time"};
+            printf("IO61:      %d syscalls (%d reads, %d writes, %d lseeks), %d cache hits, %d misses, %d/%d prefetched blocks used, %d flushes\n",
+                   $tt->{"syscalls"}, $tt->{"reads"}, $tt->{"writes"},
+                   $tt->{"lseeks"}, $tt->{"hits"}, $tt->{"misses"},
+                   $tt->{"prefetch_used"}, $tt->{"prefetched"},
+                   $tt->{"flushes"})
+                if $VERBOSE && exists($tt->{"syscalls"});
         }
 
         # print stdio vs. yourcode comparison
@@ -669,6 +724,10 @@ makefile("files/text1meg.txt", 1 << 20);
 makebinaryfile("files/binary1meg.bin", 1 << 20);
 makefile("files/text5meg.txt", 5 << 20);
 makefile("files/text20meg.txt", 20 << 20);
+makesparsefile("files/sparse20meg.bin", 20 << 20);
+for (my $i = 1; $i <= 16; ++$i) {
+    makesortedfile("files/sorted1meg-$i.txt", 1 << 20, $i);
+}
 
 $SIG{"INT"} = sub {
     kill 9, -$run61_pid if $run61_pid;
@@ -820,6 +879,183 @@ enqueue(28,
     "redirected large file, 1B-4KB block I/O, sequential");
 
 
+
+# KERNEL COPIES
+
+enqueue(29,
+    "./cat61 -z -o files/out.txt files/text20meg.txt",
+    "regular large file, io61_copy, sequential");
+
+enqueue(30,
+    "./blockcat61 -z -b 100000 -o files/out.txt files/text5meg.txt",
+    "regular medium file, 100KB io61_copy, sequential");
+
+enqueue(31,
+    "cat files/text20meg.txt | ./cat61 -z | cat > files/out.txt",
+    "piped large file, io61_copy, sequential");
+
+enqueue(32,
+    "./gather61 -z -b 8192 -o files/out.bin files/binary1meg.bin files/text1meg.txt",
+    "gathered small files, 8KB io61_copy, sequential");
+
+
+# DIRECT I/O
+
+enqueue(33,
+    "./blockcat61 -D -b 65536 -o files/out.txt files/text20meg.txt",
+    "regular large file, O_DIRECT 64KB block I/O, sequential");
+
+enqueue(34,
+    "./cat61 -D -o files/out.txt files/text5meg.txt",
+    "regular medium file, O_DIRECT character I/O, sequential");
+
+
+# CONCURRENT READERS
+
+enqueue(35,
+    "./pscan61 -j 4 -b 4096 -o files/out.txt files/text20meg.txt",
+    "regular large file, 4 threads, 4KB io61_pread, sequential");
+
+enqueue(36,
+    "./pscan61 -j 4 -b 512 -s 20971520 -o files/out.txt /dev/zero",
+    "magic zero file, 4 threads, 512B io61_pread, sequential");
+
+
+# THREAD PIPELINES
+
+enqueue(37,
+    "./pipe61 -j 4 -o files/out.txt files/text20meg.txt",
+    "regular large file, 4 workers, 1MB copy pipeline, sequential");
+
+enqueue(38,
+    "./pipe61 -j 4 -x upper -o files/out.txt files/text20meg.txt",
+    "regular large file, 4 workers, 1MB upper-case pipeline, sequential");
+
+enqueue(39,
+    "cat files/text20meg.txt | ./pipe61 -j 4 -b 65536 -x lower | cat > files/out.txt",
+    "piped large file, 4 workers, 64KB lower-case pipeline, sequential");
+
+enqueue(40,
+    "./pipe61 -j 4 -x sum -o files/out.txt files/text20meg.txt",
+    "regular large file, 4 workers, 1MB checksum pipeline, sequential");
+
+
+# LINE I/O
+
+enqueue(41,
+    "./wc61 -o files/out.txt files/text20meg.txt",
+    "regular large file, io61_readline, sequential");
+
+enqueue(42,
+    "cat files/text20meg.txt | ./wc61 | cat > files/out.txt",
+    "piped large file, io61_readline, sequential");
+
+enqueue(43,
+    "./wc61 -D -o files/out.txt files/text5meg.txt",
+    "regular medium file, O_DIRECT io61_readline, sequential");
+
+
+# SPARSE FILES
+
+enqueue(44,
+    "./blockcat61 -o files/out.bin files/sparse20meg.bin",
+    "sparse large file, 4KB block I/O, sequential");
+
+enqueue(45,
+    "./reordercat61 -o files/out.bin files/sparse20meg.bin",
+    "sparse large file, 4KB block I/O, random seek order");
+
+
+# COMPRESSION
+
+enqueue(46,
+    "./lz61 files/text20meg.txt | ./lz61 -d | cat > files/out.txt",
+    "piped large file, compress then decompress, sequential");
+
+enqueue(47,
+    "./lz61 -o files/packed.lz files/text20meg.txt && ./lz61 -d -o files/out.txt files/packed.lz",
+    "regular large file, compress then decompress, sequential");
+
+# `$slowcat FILE` writes FILE in 30000-byte pieces, pausing every 10 pieces,
+# so the reader sees short reads and a writer flushes often
+my($slowcat) = q{perl -e 'open(F, $ARGV[0]) || die; $| = 1; while (read(F, $b, 30000)) { print $b; select(undef, undef, undef, 0.001) if ++$n % 10 == 0 }'};
+
+enqueue(48,
+    "$slowcat files/text20meg.txt | ./lz61 | ./lz61 -d | cat > files/out.txt",
+    "slow pipe, compress then decompress, sequential");
+
+enqueue(49,
+    "./lz61 -o files/packed.lz files/text20meg.txt && $slowcat files/packed.lz | ./lz61 -d | cat > files/out.txt",
+    "slow pipe, decompress, sequential");
+
+
+# READ/WRITE FILES
+
+enqueue(50,
+    "cp files/text5meg.txt files/out.txt && ./patch61 files/out.txt",
+    "regular medium file, 128B record updates in place, random seek order");
+
+enqueue(51,
+    "cp files/text5meg.txt files/out.txt && ./patch61 -b 1000 -r 9 files/out.txt",
+    "regular medium file, 1000B record updates in place, random seek order");
+
+
+# LINE MERGING
+
+enqueue(52,
+    "./merge61 -o files/out.txt files/sorted1meg-1.txt files/sorted1meg-2.txt",
+    "regular small files, 2-way merge of sorted lines, sequential");
+
+enqueue(53,
+    "./merge61 -o files/out.txt "
+    . join(" ", map { "files/sorted1meg-$_.txt" } 1..16),
+    "regular small files, 16-way merge of sorted lines, sequential");
+
+enqueue(54,
+    "./merge61 files/sorted1meg-1.txt files/sorted1meg-2.txt files/sorted1meg-3.txt files/sorted1meg-4.txt | cat > files/out.txt",
+    "regular small files, 4-way merge of sorted lines to a pipe, sequential");
+
+
+# SORTING
+
+enqueue(55,
+    "./sort61 -o files/out.txt files/text5meg.txt",
+    "regular medium file, in-memory line sort");
+
+enqueue(56,
+    "./sort61 -S 1M -o files/out.txt files/text20meg.txt",
+    "regular large file, external line sort in 1MB, two merge passes");
+
+enqueue(57,
+    "cat files/text20meg.txt | ./sort61 -S 4M -j 4 | cat > files/out.txt",
+    "piped large file, external line sort in 4MB, 4 threads");
+
+
+# CHECKSUMS
+
+enqueue(58,
+    "./lz61 -k files/text20meg.txt | ./lz61 -d | cat > files/out.txt",
+    "piped large file, checksum then verify, sequential");
+
+enqueue(59,
+    "./lz61 -k -o files/packed.ck files/text20meg.txt && ./lz61 -d -o files/out.txt files/packed.ck",
+    "regular large file, checksum then verify, sequential");
+
+
+# INHERITED FILE POSITIONS
+
+enqueue(60,
+    "(read line; ./cat61 > files/out.txt) < files/text5meg.txt",
+    "regular medium file, read from where the shell left stdin");
+
+enqueue(61,
+    "(echo HEADER; ./cat61 files/text5meg.txt) > files/out.txt",
+    "regular medium file, written after what the shell wrote to stdout");
+
+enqueue(62,
+    "echo HEADER > files/out.bin && ./cat61 files/sparse20meg.bin >> files/out.bin",
+    "sparse large file, appended to an existing file");
+
 run($sequentially);
 
 summary();
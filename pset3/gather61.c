@@ -1,20 +1,22 @@
 #include "io61.h"
 
-// Usage: ./gather61 [-b BLOCKSIZE] [-o OUTFILE] [FILE1 FILE2...]
+// Usage: ./gather61 [-b BLOCKSIZE] [-o OUTFILE] [-z] [FILE1 FILE2...]
 //    Copies the input FILEs to OUTFILE, alternating between
 //    FILEs with every block. (I.e., read a block from FILE1, then
 //    a block from FILE2, etc.) This is a "gather" I/O pattern: many
-//    input files are gathered into a single output file.
-//    Default BLOCKSIZE is 1.
+//    input files are gathered into a single output file. Each round's
+//    blocks are written to OUTFILE with one io61_writev.
+//    Default BLOCKSIZE is 1. With -z, copies each block with io61_copy.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args = io61_parse_arguments(argc, argv, "b:o:#");
+    io61_arguments args = io61_parse_arguments(argc, argv, "b:o:z#");
     size_t block_size = args.block_size ? args.block_size : 1;
 
-    // Allocate buffer, open files
-    char* buf = (char*) malloc(block_size);
+    // Allocate buffers, open files
     int nfiles = args.n_input_files;
+    char* buf = (char*) malloc(block_size * nfiles);
+    struct iovec* iov = (struct iovec*) calloc(nfiles, sizeof(struct iovec));
 
     io61_profile_begin();
     io61_file** infs = (io61_file**) calloc(nfiles, sizeof(io61_file*));
@@ -24,24 +26,39 @@ int main(int argc, char* argv[]) {
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
 
-    // Copy file data
-    int whichf = 0, ndeadfiles = 0;
+    // Copy file data, one block from each remaining file per round
+    int ndeadfiles = 0;
     while (ndeadfiles != nfiles) {
-        if (infs[whichf]) {
-            ssize_t amount = io61_read(infs[whichf], buf, block_size);
+        int niov = 0;
+        for (int whichf = 0; whichf != nfiles; ++whichf) {
+            if (!infs[whichf]) {
+                continue;
+            }
+            ssize_t amount;
+            char* p = buf + niov * block_size;
+            if (args.zero_copy) {
+                amount = io61_copy(outf, infs[whichf], block_size);
+            } else {
+                amount = io61_read(infs[whichf], p, block_size);
+            }
             if (amount <= 0) {
                 io61_close(infs[whichf]);
                 infs[whichf] = NULL;
                 ++ndeadfiles;
-            } else {
-                io61_write(outf, buf, amount);
+            } else if (!args.zero_copy) {
+                iov[niov].iov_base = p;
+                iov[niov].iov_len = amount;
+                ++niov;
             }
         }
-        whichf = (whichf + 1) % nfiles;
+        if (niov != 0) {
+            io61_writev(outf, iov, niov);
+        }
     }
 
     io61_close(outf);
     io61_profile_end();
     free(infs);
+    free(iov);
     free(buf);
 }
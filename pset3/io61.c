@@ -1,331 +1,4253 @@
+#define _GNU_SOURCE 1   // copy_file_range(), splice()
 #include "io61.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>  // _mm_crc32_u64()
+#endif
+#if IO61_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#undef BLOCK_SIZE       // <linux/fs.h> has its own
+#endif
 
 // io61.c
 //    YOUR CODE HERE!
 
 
+// defines block size, number, starting pos, and offset. Every file
+// shares the cache's blocks, so the block size is the same for all of
+// them; what varies per file is how many blocks one system call moves
+// (see run_tune()).
+#define BLOCK_SHIFT 12
+#define BLOCK_SIZE (1 << BLOCK_SHIFT)
+
+static inline off_t find_block(off_t off) {
+    return off >> BLOCK_SHIFT;
+    //return off/BLOCK_SIZE;
+}
+
+static inline off_t find_block_pos(off_t off) {
+    return off & ~(off_t) (BLOCK_SIZE - 1);
+    //return find_block(off) * BLOCK_SIZE;
+}
+
+static inline int find_block_ofs(off_t off) {
+    return off & (off_t) (BLOCK_SIZE - 1);
+    //return off % BLOCK_SIZE;
+}
+
+
+// io61 buffer cache
+//    All open files share one bounded pool of BLOCK_SIZE buffers, found by
+//    (file, block number) through a hash table and replaced with CLOCK.
+//    Buffers are only allocated when the pool first grows into them, so an
+//    open file costs no buffer memory until it is used. Each file may hold
+//    at most `limit` blocks: sequential access needs only a couple, and a
+//    file whose misses hit blocks it recently lost earns a bigger share.
+
+#define CACHE_BLOCKS 256        // pool capacity (1 MiB of buffers)
+#define CACHE_HASH_BITS 9       // 512 hash buckets
+#define CACHE_SEQ_LIMIT 2       // initial per-file block limit
+#define NGHOSTS 8               // recently evicted blocks remembered per file
+#define RA_MAX 16               // starting run: read-ahead and write-back
+#define RUN_MAX 256             // longest run (1 MiB), in blocks
+#define RUN_SAMPLE (4 << 20)    // bytes timed per run size (run_tune())
+#define PREFETCH_DEPTH 8        // strided accesses prefetched ahead
+#define DIRTY_RANGES 8          // max separate dirty ranges per block
+#define FLUSH_IOV 256           // max iovecs per pwritev()
+#define WB_RUN RUN_MAX          // max neighbors written back with a block
+
+typedef struct io61_block {
+    unsigned char* buf;     // BLOCK_SIZE buffer, NULL until first use
+    io61_file* f;           // owning file, NULL if free
+    off_t block;            // block number
+    off_t pos;              // block pos
+    ssize_t sz;             // size of cached data (read, read/write modes)
+    int ndirty;             // number of dirty ranges (write, read/write modes)
+    unsigned short dirty_lo[DIRTY_RANGES]; // sorted, disjoint dirty ranges
+    unsigned short dirty_hi[DIRTY_RANGES]; // [dirty_lo[k], dirty_hi[k])
+    int ref;                // CLOCK reference bit
+    int pin;                // don't replace (read-ahead in progress)
+    int ahead;              // read ahead and not used yet
+    int hnext;              // next block in hash chain, -1 at end
+    int fprev, fnext;       // owning file's block list, most recent first
+} io61_block;
+
+static struct io61_cache {
+    io61_block blocks[CACHE_BLOCKS];
+    int hash[1 << CACHE_HASH_BITS];
+    int nused;              // blocks[0, nused) have ever been handed out
+    int nfiles;             // number of open files
+    int hand;               // CLOCK hand
+    int initialized;
+} cache;
+
+
+// I/O statistics
+//    Each file counts the system calls it makes, by type, the bytes they
+//    move, and how its buffering worked out; io61_stats_json() reports the
+//    counts. They live in a table that outlasts the file, so a report made
+//    after io61_close() still has them. Once the table is full, later files
+//    share its last entry. Calls that belong to no file (io_uring setup and
+//    submission, the direct I/O buffer pool) are counted in `stats.misc`.
+
+#define ST_READS 0              // read(), pread(), preadv(), io_uring reads
+#define ST_WRITES 1             // write(), pwrite(), pwritev(), io_uring writes
+#define ST_LSEEKS 2             // lseek()
+#define ST_COPIES 3             // copy_file_range(), sendfile(), splice()
+#define ST_MAPS 4               // mmap(), munmap()
+#define ST_HINTS 5              // madvise(), posix_fadvise()
+#define ST_WAITS 6              // poll(), io_uring_enter()
+#define ST_OTHER 7              // fstat(), statx(), fcntl(), pipe(), close()
+#define ST_NCALLS 8             // the counts above are system calls
+#define ST_BYTES_READ 8         // bytes moved by those calls
+#define ST_BYTES_WRITTEN 9
+#define ST_HITS 10              // block cache lookups that found the block
+#define ST_MISSES 11            // block cache lookups that didn't
+#define ST_SEEKS 12             // io61_seek() calls
+#define ST_SEEKS_ELIDED 13      // io61_seek() calls that cost no lseek()
+#define ST_PREFETCHED 14        // blocks read ahead of need
+#define ST_PREFETCH_USED 15     // read-ahead blocks used later
+#define ST_PREFETCH_WASTED 16   // read-ahead blocks dropped unused
+#define ST_FLUSHES 17           // write-backs of buffered data
+#define ST_HOLES 18             // zero blocks left as holes, hole blocks
+                                // zero-filled instead of read
+#define ST_LZ_RAW 19            // bytes compressed or decompressed
+#define ST_LZ_PACKED 20         // their compressed size, with headers
+#define ST_LZ_USEC 21           // microseconds spent in the codec
+#define NSTATS 22
+#define STATS_FILES 16          // max files reported separately
+
+static const char* const stat_names[NSTATS] = {
+    "reads", "writes", "lseeks", "copies", "maps", "hints", "waits",
+    "other_calls", "bytes_read", "bytes_written", "hits", "misses",
+    "seeks", "seeks_elided", "prefetched", "prefetch_used",
+    "prefetch_wasted", "flushes", "holes", "lz_raw_bytes", "lz_packed_bytes", "lz_usec"
+};
+
+typedef struct io61_stats {
+    char name[64];          // file name, JSON-escaped
+    unsigned long long n[NSTATS];
+} io61_stats;
+
+static struct {
+    io61_stats file[STATS_FILES];
+    int nfiles;             // number of files ever opened
+    io61_stats misc;
+} stats;
+
+
 // io61_file
 //    Data structure for io61 file wrappers. Add your own stuff.
 
-// defines block size, number, starting pos, and offset
-#define BLOCK_SIZE 0x1000
-//#define BLOCK_SIZE 4096
+typedef struct io61_file {
+    io61_cursor c; // io61_readc()/io61_writec() cursor (see cursor_sync())
+    int fd;
+    int mode;
+    off_t pos; // logical file pos, maybe cached
+    //int allowseek; // is file seekable
+    off_t f_pos; // actual file pos,
+    off_t f_size; // read mode; read/write mode, including unflushed growth
+    int seekable;  // 0 for pipes and other files that can't seek
+    int append;    // writer opened with O_APPEND: every write goes to
+                   // the end, wherever it is aimed
+    int pattern;   // detected access pattern (IO61_SEQUENTIAL etc.)
+    off_t stride;  // distance between accesses (IO61_STRIDED, IO61_REVERSE)
+    int cand;      // candidate pattern, with its stride and how many
+    off_t cand_stride; // accesses in a row agreed on it
+    int votes;
+    off_t last_start; // where the last seeking access started
+    off_t last_delta; // and how far it was from the one before
+    unsigned nseeks;  // number of io61_seek()s that moved the position
+    unsigned miss_seeks; // nseeks at the last miss
+    int ra;        // read-ahead size in blocks
+    int run;       // blocks a sequential read-ahead or write-back moves at
+                   // once, at most (see run_tune())
+    int run_done;  // `run` is settled
+    int run_n;     // runs timed at this size so far
+    size_t run_bytes; // and the bytes they moved
+    unsigned long long run_t0; // when the first of them ended, in ns
+    double run_rate; // bytes per ns at the previous size; 0 if none, -1
+                     // in the first sample, which only warms up
+    off_t ra_mark; // mapped reverse scans prefetch again below this pos
+    int eof;       // set when a read hit end of file
+    int cur;       // cache index of the block used last, or -1
+    int head, tail; // this file's cached blocks, most recent first
+    int nblocks;   // number of cached blocks
+    int limit;     // max number of cached blocks
+    off_t ghosts[NGHOSTS]; // recently evicted block numbers
+    int ghost_i;
+    unsigned char* map; // mapped window of a read-only regular file, or NULL
+    off_t map_pos;  // file pos of the window
+    size_t map_sz;  // size of the window
+    int map_advice; // madvise() hint for the mapping
+    struct io61_async* async; // read-ahead thread, or NULL
+    int werror;    // a queued write failed (see io61_flush())
+    char* sbuf;    // stream buffer (see stream_fill()), or NULL
+    size_t s_cap;  // its size
+    size_t s_off;  // unread data (reader) or unwritten data (writer)
+    size_t s_len;  // is sbuf[s_off, s_len)
+    int nowait;    // stream_io() can try without blocking
+    int s_pin;     // io61_readline()'s line is in sbuf, so don't move it
+    struct io61_file* snext; // next open stream
+    char* dbuf;    // O_DIRECT transfer buffer (see direct_read()), or NULL
+    off_t d_pos;   // file pos of dbuf[0], a multiple of d_align
+    size_t d_lo;   // data read (reader, with d_lo == 0) or not yet
+    size_t d_hi;   // written (writer) is dbuf[d_lo, d_hi)
+    size_t d_align; // O_DIRECT alignment of offsets, lengths and memory
+    io61_stats* st; // counters (see io61_stats_json())
+    int seek_owed; // the last io61_seek() hasn't needed an lseek() yet
+    struct io61_shared* shared; // io61_pread()'s blocks, or NULL
+    char* lbuf;    // io61_readline()'s copy of a line that spans buffers
+    size_t lbuf_sz;
+    int line_blk;  // cache block holding io61_readline()'s line, or -1
+    unsigned char* c_start; // where the cursor was at `pos`
+    unsigned char* c_lo;    // start of the read cursor's buffer
+    int c_blk;     // cache block the cursor is in, or -1
+    int sparse;    // the file may have holes (reader, see hole_fill()), or
+                   // may get some (writer, see flush_blocks())
+    off_t x_pos, x_end; // reader: [x_pos, x_end) is all hole (if `x_hole`)
+    int x_hole;         // or all data
+    off_t z_end;   // writer: end of the zero blocks left as holes
+    struct io61_lz* lz; // compression state (see lz_open()), or NULL
+} io61_file;
+
+
+// access patterns
+#define IO61_SEQUENTIAL 0
+#define IO61_REVERSE 1
+#define IO61_STRIDED 2
+#define IO61_RANDOM 3
+
+static int flush_block(io61_file* f, io61_block* b, int queue);
+static int flush_around(io61_file* f, int i, int queue);
+static void uring_wait(io61_block* b);
+static void uring_writebehind(io61_file* f);
+static int flush_blocks(io61_file* f, const int* idx, int n, int queue);
+static int block_compare(const void* a, const void* b);
+static void detect_miss(io61_file* f);
+static void shared_free(io61_file* f);
+static void line_unpin(io61_file* f);
+static void cursor_close(io61_file* f);
+static int lz_close(io61_file* f);
+static inline void count_shared(io61_file* f, int stat, unsigned long long n);
+
+
+// count_io(f, stat, r)
+//    count a read or write system call by `f` that returned `r`
+static inline void count_io(io61_file* f, int stat, ssize_t r) {
+    ++f->st->n[stat];
+    if (r > 0)
+        f->st->n[stat == ST_READS ? ST_BYTES_READ : ST_BYTES_WRITTEN] += r;
+}
+
+
+// cache_hash(f, block)
+//    hash bucket for (file, block number)
+static inline unsigned cache_hash(io61_file* f, off_t block) {
+    uint64_t h = ((uint64_t) (uintptr_t) f ^ ((uint64_t) block << 16))
+        * 0x9E3779B97F4A7C15ULL;
+    return h >> (64 - CACHE_HASH_BITS);
+}
+
+static void cache_init(void) {
+    for (int i = 0; i < (1 << CACHE_HASH_BITS); ++i)
+        cache.hash[i] = -1;
+    cache.initialized = 1;
+}
+
+// cache_lookup(f, block)
+//    return the cache index holding `f`'s block `block`, or -1
+static int cache_lookup(io61_file* f, off_t block) {
+    if (f->cur >= 0 && cache.blocks[f->cur].f == f
+        && cache.blocks[f->cur].block == block)
+        return f->cur;
+    for (int i = cache.hash[cache_hash(f, block)]; i >= 0; i = cache.blocks[i].hnext)
+        if (cache.blocks[i].f == f && cache.blocks[i].block == block)
+            return i;
+    return -1;
+}
+
+// file list helpers: each file keeps its blocks in recency order
+static void flist_remove(io61_file* f, int i) {
+    io61_block* b = &cache.blocks[i];
+    if (b->fprev >= 0)
+        cache.blocks[b->fprev].fnext = b->fnext;
+    else
+        f->head = b->fnext;
+    if (b->fnext >= 0)
+        cache.blocks[b->fnext].fprev = b->fprev;
+    else
+        f->tail = b->fprev;
+}
+
+static void flist_push(io61_file* f, int i) {
+    io61_block* b = &cache.blocks[i];
+    b->fprev = -1;
+    b->fnext = f->head;
+    if (f->head >= 0)
+        cache.blocks[f->head].fprev = i;
+    else
+        f->tail = i;
+    f->head = i;
+}
+
+// cache_touch(f, i)
+//    mark block `i` as just used by `f`
+static inline void cache_touch(io61_file* f, int i) {
+    cache.blocks[i].ref = 1;
+    if (f->head != i) {
+        flist_remove(f, i);
+        flist_push(f, i);
+    }
+    f->cur = i;
+}
+
+// cache_hit(f, b)
+//    count a lookup of `f` that found cached block `b`
+static inline void cache_hit(io61_file* f, io61_block* b) {
+    ++f->st->n[ST_HITS];
+    if (b->ahead) {
+        b->ahead = 0;
+        ++f->st->n[ST_PREFETCH_USED];
+    }
+}
+
+// cache_unlink(i)
+//    detach block `i` from its file, dropping its contents
+static void cache_unlink(int i) {
+    io61_block* b = &cache.blocks[i];
+    io61_file* f = b->f;
+    int* hp = &cache.hash[cache_hash(f, b->block)];
+    while (*hp != i)
+        hp = &cache.blocks[*hp].hnext;
+    *hp = b->hnext;
+    flist_remove(f, i);
+    --f->nblocks;
+    if (b->ahead)
+        ++f->st->n[ST_PREFETCH_WASTED];
+    b->ahead = 0;
+    b->f = NULL;
+}
+
+// cache_evict(i)
+//    write back block `i` if dirty and detach it from its file
+static int cache_evict(int i) {
+    io61_block* b = &cache.blocks[i];
+    io61_file* f = b->f;
+    if (!f)
+        return 0;
+    int r = flush_around(f, i, 0);
+    f->ghosts[f->ghost_i] = b->block;
+    f->ghost_i = (f->ghost_i + 1) % NGHOSTS;
+    cache_unlink(i);
+    return r;
+}
+
+// file_limit(f)
+//    the number of blocks `f` may keep. A sequential writer gets `f->run`
+//    blocks, so that write-back goes out in runs that long, unless the
+//    open files together would need more than the cache holds.
+static int file_limit(io61_file* f) {
+    if (f->mode != O_WRONLY || f->pattern != IO61_SEQUENTIAL
+        || f->limit >= f->run)
+        return f->limit;
+    int share = CACHE_BLOCKS / cache.nfiles;
+    if (share > f->run)
+        share = f->run;
+    return share > f->limit ? share : f->limit;
+}
+
+// run_tune(f, n)
+//    a sequential run of `f` just moved `n` bytes. Runs are timed until
+//    they have moved RUN_SAMPLE bytes, from the end of the run before
+//    them, so the time counts the caller's work between runs as well as
+//    the system calls. While doubling `f->run` buys at least 1/8 more
+//    throughput it doubles again, up to RUN_MAX or the file's share of
+//    the cache; the first doubling that doesn't settles it, undone if it
+//    was slower. The file's first sample is thrown away.
+static void run_tune(io61_file* f, size_t n) {
+    if (f->run_done)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (f->run_n++ == 0) {
+        f->run_t0 = now;
+        f->run_bytes = 0;
+        return;
+    }
+    f->run_bytes += n;
+    if (f->run_bytes < RUN_SAMPLE)
+        return;
+    double rate = (double) f->run_bytes / (now - f->run_t0 + 1);
+    int max = CACHE_BLOCKS / cache.nfiles;
+    if (max > RUN_MAX)
+        max = RUN_MAX;
+    if (f->run_rate < 0)
+        f->run_rate = 0;
+    else if (f->run_rate == 0 || rate >= f->run_rate * 1.125) {
+        f->run_rate = rate;
+        if (2 * f->run <= max)
+            f->run *= 2;
+        else
+            f->run_done = 1;
+    } else {
+        if (rate < f->run_rate)
+            f->run /= 2;
+        f->run_done = 1;
+    }
+    f->run_n = 0;
+}
+
+// cache_victim(f)
+//    choose a block for `f` to (re)use: its own least recently used block
+//    if it is at its limit, otherwise an untouched or CLOCK-chosen block
+static int cache_victim(io61_file* f) {
+    int limit = file_limit(f);
+    if (f->nblocks >= limit && f->tail >= 0)
+        uring_writebehind(f);
+    if (f->nblocks >= limit && f->tail >= 0 && !cache.blocks[f->tail].pin)
+        return f->tail;
+    if (cache.nused < CACHE_BLOCKS)
+        return cache.nused++;
+    for (int n = 0; 1; ++n) {
+        int i = cache.hand;
+        cache.hand = (cache.hand + 1) % CACHE_BLOCKS;
+        io61_block* b = &cache.blocks[i];
+        if (!b->f)
+            return i;
+        // after a full lap of blocks in flight, wait for one to land
+        if (b->pin && n >= CACHE_BLOCKS)
+            uring_wait(b);
+        if (b->pin)
+            continue;
+        if (!b->ref)
+            return i;
+        b->ref = 0;
+    }
+}
+
+// cache_alloc(f, block)
+//    return a cache index for `f`'s block `block`, which must not be
+//    cached already; the block starts out empty
+static int cache_alloc(io61_file* f, off_t block) {
+    // a miss on a block we recently evicted means the working set is
+    // bigger than the limit
+    for (int g = 0; g < NGHOSTS; ++g)
+        if (f->ghosts[g] == block) {
+            f->limit *= 2;
+            if (f->limit > CACHE_BLOCKS)
+                f->limit = CACHE_BLOCKS;
+            f->ghosts[g] = -1;
+            break;
+        }
+
+    int i = cache_victim(f);
+    io61_block* b = &cache.blocks[i];
+    cache_evict(i);
+    uring_wait(b);
+    if (!b->buf) {
+        b->buf = (unsigned char*) malloc(BLOCK_SIZE);
+        assert(b->buf);
+    }
+    b->f = f;
+    b->block = block;
+    b->pos = block * BLOCK_SIZE;
+    b->sz = 0;
+    b->ndirty = 0;
+    b->ref = 1;
+    b->pin = 0;
+    b->ahead = 0;
+    unsigned h = cache_hash(f, block);
+    b->hnext = cache.hash[h];
+    cache.hash[h] = i;
+    flist_push(f, i);
+    ++f->nblocks;
+    f->cur = i;
+    return i;
+}
+
+// cache_release(f)
+//    write back and drop all blocks belonging to `f`
+static int cache_release(io61_file* f) {
+    int r = 0;
+    while (f->head >= 0)
+        if (cache_evict(f->head) < 0)
+            r = -1;
+    f->cur = -1;
+    return r;
+}
+
+
+// seek_to(f, pos)
+//    move the real file position to `pos` if it isn't there already
+static int seek_to(io61_file* f, off_t pos) {
+    if (f->f_pos == pos)
+        return 0;
+    if (!f->seekable)
+        return -1;
+    ++f->st->n[ST_LSEEKS];
+    f->seek_owed = 0;
+    if (lseek(f->fd, pos, SEEK_SET) == (off_t) -1)
+        return -1;
+    f->f_pos = pos;
+    return 0;
+}
+
+// write_all(f, p, n)
+//    write `n` bytes at the real file position, retrying short writes
+static int write_all(io61_file* f, const void* p, size_t n) {
+    const char* cp = (const char*) p;
+    while (n > 0) {
+        ssize_t r = write(f->fd, cp, n);
+        count_io(f, ST_WRITES, r);
+        if (r == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (r <= 0)
+            return -1;
+        f->f_pos += r; // keep track of real file position
+        cp += r;
+        n -= r;
+    }
+    return 0;
+}
+
+// asynchronous read-ahead
+//    With IO61_ASYNC=N in the environment, a read-only file that can't
+//    seek (a pipe, socket or terminal) gets a thread that reads ahead into
+//    a ring of N buffers while the program works on earlier data. The
+//    thread fills buffers and the reader empties them, one side each, so
+//    the ring needs no lock: `filled` and `empty` count the buffers on
+//    each side and are only waited on when one side gets ahead. Reads
+//    that go through stream_readv() take data from the ring instead of
+//    from the file descriptor.
+
+#define ASYNC_MAX 64                    // max buffers in a ring
+#define ASYNC_BUF (16 * BLOCK_SIZE)     // size of each buffer
+
+typedef struct io61_async {
+    pthread_t thread;
+    int fd;
+    int depth;              // number of buffers
+    unsigned char* buf[ASYNC_MAX];
+    ssize_t len[ASYNC_MAX]; // bytes in each filled buffer; 0 at end of
+                            // file, -1 on error (see `error`)
+    int error;
+    unsigned head;          // buffers filled (thread only)
+    unsigned tail;          // buffers used up (reader only)
+    size_t ofs;             // bytes of buffer `tail` already used
+    int held;               // reader has taken buffer `tail` from `filled`
+    sem_t filled;           // number of filled buffers not yet taken
+    sem_t empty;            // number of buffers free to fill
+    io61_stats* st;         // the file's counters (reader only)
+} io61_async;
+
+static int async_depth = -1;    // IO61_ASYNC, or 0 if unset
+
+// async_thread(arg)
+//    read-ahead thread: fill buffers until end of file or error
+static void* async_thread(void* arg) {
+    io61_async* a = (io61_async*) arg;
+    while (1) {
+        while (sem_wait(&a->empty) == -1) {
+        }
+        unsigned slot = a->head % a->depth;
+        ssize_t r;
+        do {
+            r = read(a->fd, a->buf[slot], ASYNC_BUF);
+        } while (r == -1 && errno == EINTR);
+        a->len[slot] = r;
+        if (r == -1)
+            a->error = errno;
+        ++a->head;
+        sem_post(&a->filled);
+        if (r <= 0)
+            return NULL;
+    }
+}
+
+// async_start(f)
+//    start read-ahead for `f` if the user asked for it
+static void async_start(io61_file* f) {
+    if (async_depth < 0) {
+        const char* s = getenv("IO61_ASYNC");
+        async_depth = s ? atoi(s) : 0;
+        if (async_depth > ASYNC_MAX)
+            async_depth = ASYNC_MAX;
+    }
+    f->async = NULL;
+    if (async_depth <= 0 || f->mode != O_RDONLY || f->seekable)
+        return;
+    io61_async* a = (io61_async*) malloc(sizeof(io61_async));
+    a->fd = f->fd;
+    a->depth = async_depth;
+    a->st = f->st;
+    for (int i = 0; i < a->depth; ++i) {
+        a->buf[i] = (unsigned char*) malloc(ASYNC_BUF);
+        assert(a->buf[i]);
+    }
+    a->head = a->tail = 0;
+    a->ofs = 0;
+    a->held = 0;
+    sem_init(&a->filled, 0, 0);
+    sem_init(&a->empty, 0, a->depth);
+    if (pthread_create(&a->thread, NULL, async_thread, a) != 0) {
+        sem_destroy(&a->filled);
+        sem_destroy(&a->empty);
+        for (int i = 0; i < a->depth; ++i)
+            free(a->buf[i]);
+        free(a);
+        return;
+    }
+    f->async = a;
+}
+
+// async_stop(f)
+//    stop `f`'s read-ahead thread and free its buffers
+static void async_stop(io61_file* f) {
+    io61_async* a = f->async;
+    if (!a)
+        return;
+    // the thread can only be blocked in read() or sem_wait(), both
+    // cancellation points
+    pthread_cancel(a->thread);
+    pthread_join(a->thread, NULL);
+    sem_destroy(&a->filled);
+    sem_destroy(&a->empty);
+    for (int i = 0; i < a->depth; ++i)
+        free(a->buf[i]);
+    free(a);
+    f->async = NULL;
+}
+
+// async_readv(a, iov, n)
+//    like readv(), but from read-ahead ring `a`: waits only if no data is
+//    ready at all
+static ssize_t async_readv(io61_async* a, const struct iovec* iov, int n) {
+    size_t total = 0;
+    int k = 0;
+    size_t kofs = 0;
+    while (k < n) {
+        if (!a->held) {
+            if (total > 0 ? sem_trywait(&a->filled) == -1
+                : sem_wait(&a->filled) == -1)
+                break;  // no more data ready, or interrupted
+            a->held = 1;
+            // the thread's read() is counted here, so only the reader
+            // touches the counters
+            ssize_t len = a->len[a->tail % a->depth];
+            ++a->st->n[ST_READS];
+            if (len > 0)
+                a->st->n[ST_BYTES_READ] += len;
+        }
+        unsigned slot = a->tail % a->depth;
+        ssize_t len = a->len[slot];
+        if (len <= 0) {
+            // end of file and errors stay in the ring for later calls
+            if (total > 0)
+                break;
+            if (len == -1)
+                errno = a->error;
+            return len;
+        }
+        size_t m = len - a->ofs;
+        if (m > iov[k].iov_len - kofs)
+            m = iov[k].iov_len - kofs;
+        memcpy((char*) iov[k].iov_base + kofs, a->buf[slot] + a->ofs, m);
+        total += m;
+        a->ofs += m;
+        kofs += m;
+        if (kofs == iov[k].iov_len) {
+            ++k;
+            kofs = 0;
+        }
+        if (a->ofs == (size_t) len) {
+            a->ofs = 0;
+            ++a->tail;
+            a->held = 0;
+            sem_post(&a->empty);
+        }
+    }
+    if (total == 0 && k < n) {
+        errno = EINTR;
+        return -1;
+    }
+    return total;
+}
+
+// stream_readv(f, iov, n)
+//    read from non-seekable `f` into `iov`, through its read-ahead ring
+//    if it has one
+static ssize_t stream_readv(io61_file* f, const struct iovec* iov, int n) {
+    if (f->async)
+        return async_readv(f->async, iov, n);
+    ssize_t r = readv(f->fd, iov, n);
+    count_io(f, ST_READS, r);
+    return r;
+}
+
+
+// read/write files
+//    A file opened O_RDWR (it must be seekable) reads and writes through one
+//    set of cached blocks. Each holds the file's data, as a reader's block
+//    does, with dirty ranges on top, as a writer's does, so reads see
+//    earlier writes, and a partial write to a cached block needs no read.
+//    A partial write to an uncached block reads the block first; a write
+//    of a whole block doesn't. Writes past the end grow `f_size`, and data
+//    between the old end and the new data reads as zeros, as it will once
+//    written.
+
+// rw_pad(f, b)
+//    zero-fill cached block `b` of read/write file `f` out to `f_size`, for
+//    data the file on disk doesn't have yet. Returns the number of bytes
+//    added.
+static ssize_t rw_pad(io61_file* f, io61_block* b) {
+    off_t end = f->f_size - b->pos;
+    if (end > BLOCK_SIZE)
+        end = BLOCK_SIZE;
+    if (end <= b->sz)
+        return 0;
+    ssize_t n = end - b->sz;
+    memset(b->buf + b->sz, 0, n);
+    b->sz = end;
+    return n;
+}
+
+// read_block()
+//     read more data into cached block `b`, after what it holds already.
+//     Returns the number of bytes read, 0 at end of file, -1 on error.
+int read_block(io61_file* f, io61_block* b) {
+    assert(f->mode != O_WRONLY);
+
+    off_t new_pos = b->pos + b->sz;
+    if (f->f_size != -1 && new_pos >= f->f_size) { // file ended
+        f->eof = 1;
+        return 0;
+    }
+    ssize_t r;
+    struct iovec iov = { b->buf + b->sz, BLOCK_SIZE - b->sz };
+    do {
+        if (f->seekable) {
+            r = pread(f->fd, iov.iov_base, iov.iov_len, new_pos);
+            count_io(f, ST_READS, r);
+        } else
+            r = stream_readv(f, &iov, 1);
+    } while (r == -1 && errno == EINTR);
+    if (r == 0 && f->mode == O_RDWR && (r = rw_pad(f, b)) > 0)
+        return r;
+    if (r <= 0) {
+        f->eof = (r == 0);
+        return r;
+    }
+    if (!f->seekable)
+        f->f_pos += r;
+    b->sz += r;
+    return r;
+}
+
+// iov_size(iov, iovcnt)
+//    return the total size of the `iovcnt` buffers in `iov`
+static size_t iov_size(const struct iovec* iov, int iovcnt) {
+    size_t sz = 0;
+    for (int i = 0; i != iovcnt; ++i)
+        sz += iov[i].iov_len;
+    return sz;
+}
+
+// iov_advance(iovp, n, r)
+//    skip the first `r` bytes of the `n` buffers at `*iovp`, which may
+//    change both the first buffer and `*iovp`. Returns the number of
+//    buffers left.
+static int iov_advance(struct iovec** iovp, int n, size_t r) {
+    struct iovec* iov = *iovp;
+    while (n > 0 && r >= iov->iov_len) {
+        r -= iov->iov_len;
+        ++iov;
+        --n;
+    }
+    if (n > 0) {
+        iov->iov_base = (char*) iov->iov_base + r;
+        iov->iov_len -= r;
+    }
+    *iovp = iov;
+    return n;
+}
+
+// write_run(f, pos, iov, n)
+//    write the `n` buffers in `iov` to `f` at `pos` with as few system
+//    calls as possible. `iov` is used up.
+static int write_run(io61_file* f, off_t pos, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t r;
+        if (f->seekable)
+            r = pwritev(f->fd, iov, n, pos);
+        else if (pos != f->f_pos)
+            return -1;
+        else
+            r = writev(f->fd, iov, n);
+        count_io(f, ST_WRITES, r);
+        if (r == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (r <= 0)
+            return -1;
+        if (!f->seekable)
+            f->f_pos += r;
+        pos += r;
+        n = iov_advance(&iov, n, r);
+    }
+    return 0;
+}
+
+// stream buffers
+//    Pipes, sockets and terminals don't use the block cache. Each gets one
+//    buffer of `s_cap` bytes: as much as the pipe holds, so one system call
+//    can fill or empty it; a block for a terminal, which moves a line at a
+//    time; or STREAM_BUF. A writer collects data there until it fills, and
+//    a reader reads with readv() into the caller's buffer and the buffer's
+//    spare room at once. Two rules keep request/response traffic moving
+//    without a system call per message:
+//    - before a read blocks, every stream writer in the process flushes,
+//      since the other side may be waiting for that data (stream_fill());
+//    - while a write can't proceed, readable streams are read into their
+//      spare room, since the other side may be stuck writing to us
+//      (stream_wait()).
+
+#define STREAM_BUF 0x10000      // stream buffer size (a default pipe's)
+#define STREAM_POLL 64          // max streams watched by stream_wait()
+
+static io61_file* streams;      // open streams, linked through `snext`
+
+// stream_io(f, iov, n, wait)
+//    readv() or writev() for stream `f`. If `!wait`, returns -1 with
+//    errno EAGAIN instead of blocking, where the kernel allows that.
+static ssize_t stream_io(io61_file* f, const struct iovec* iov, int n,
+                         int wait) {
+    if (!wait && f->nowait) {
+        ssize_t r;
+        if (f->mode == O_RDONLY)
+            r = preadv2(f->fd, iov, n, -1, RWF_NOWAIT);
+        else
+            r = pwritev2(f->fd, iov, n, -1, RWF_NOWAIT);
+        count_io(f, f->mode == O_RDONLY ? ST_READS : ST_WRITES, r);
+        if (r != -1 || (errno != EOPNOTSUPP && errno != EINVAL))
+            return r;
+        f->nowait = 0;
+    }
+    if (f->mode == O_RDONLY)
+        return stream_readv(f, iov, n);
+    ssize_t r = writev(f->fd, iov, n);
+    count_io(f, ST_WRITES, r);
+    return r;
+}
+
+// stream_absorb(f)
+//    read whatever stream reader `f` has waiting into its spare room
+static void stream_absorb(io61_file* f) {
+    if (f->s_off > 0 && !f->s_pin) {
+        memmove(f->sbuf, f->sbuf + f->s_off, f->s_len - f->s_off);
+        f->s_len -= f->s_off;
+        f->s_off = 0;
+    }
+    struct iovec iov = { f->sbuf + f->s_len, f->s_cap - f->s_len };
+    ssize_t r = stream_io(f, &iov, 1, 0);
+    if (r > 0) {
+        f->s_len += r;
+        f->f_pos += r;
+    } else if (r == 0)
+        f->eof = 1;
+}
+
+// stream_wait(f)
+//    wait until stream writer `f` can take more data, reading any data
+//    that arrives for other streams meanwhile
+static void stream_wait(io61_file* f) {
+    struct pollfd p[STREAM_POLL];
+    io61_file* s[STREAM_POLL];
+    int n = 1;
+    p[0].fd = f->fd;
+    p[0].events = POLLOUT;
+    for (io61_file* x = streams; x && n < STREAM_POLL; x = x->snext) {
+        // stream_absorb() moves the data under `x`'s cursor
+        if (x->mode == O_RDONLY)
+            cursor_close(x);
+        if (x->mode == O_RDONLY && !x->async && !x->eof
+            && (x->s_len < x->s_cap || (x->s_off > 0 && !x->s_pin))) {
+            s[n] = x;
+            p[n].fd = x->fd;
+            p[n].events = POLLIN;
+            ++n;
+        }
+    }
+    ++f->st->n[ST_WAITS];
+    if (poll(p, n, -1) <= 0)
+        return;
+    for (int k = 1; k < n; ++k)
+        if (p[k].revents)
+            stream_absorb(s[k]);
+}
+
+// stream_write(f, iov, n)
+//    write out stream writer `f`'s buffer followed by the `n` (at most
+//    FLUSH_IOV) buffers in `iov`. The stream buffer is emptied even on
+//    error.
+static int stream_write(io61_file* f, const struct iovec* iov, int n) {
+    struct iovec v[FLUSH_IOV + 1];
+    struct iovec* vp = v;
+    int nv = 0;
+    if (f->s_len > 0) {
+        v[nv].iov_base = f->sbuf;
+        v[nv].iov_len = f->s_len;
+        ++nv;
+    }
+    memcpy(v + nv, iov, n * sizeof(*iov));
+    nv += n;
+    if (f->s_len > 0)
+        ++f->st->n[ST_FLUSHES];
+    f->s_len = 0;
+    while (nv > 0) {
+        ssize_t r = stream_io(f, vp, nv, 0);
+        if (r == -1 && errno == EAGAIN) {
+            stream_wait(f);
+            continue;
+        }
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        f->f_pos += r;
+        nv = iov_advance(&vp, nv, r);
+    }
+    return 0;
+}
+
+// stream_put(f, iov, n)
+//    write the `n` buffers in `iov` to stream writer `f`, keeping them
+//    in its buffer if they fit
+static int stream_put(io61_file* f, const struct iovec* iov, int n) {
+    if (f->s_len + iov_size(iov, n) <= f->s_cap) {
+        for (int k = 0; k < n; ++k) {
+            memcpy(f->sbuf + f->s_len, iov[k].iov_base, iov[k].iov_len);
+            f->s_len += iov[k].iov_len;
+        }
+        return 0;
+    }
+    while (n > 0) {
+        int k = n < FLUSH_IOV ? n : FLUSH_IOV;
+        if (stream_write(f, iov, k) == -1)
+            return -1;
+        iov += k;
+        n -= k;
+    }
+    return 0;
+}
+
+// streams_flush(dirty_only)
+//    write out all stream writers' buffers. If `dirty_only`, just return
+//    whether any has data.
+static int streams_flush(int dirty_only) {
+    for (io61_file* x = streams; x; x = x->snext) {
+        if (x->mode == O_WRONLY)
+            cursor_close(x);
+        if (x->mode == O_WRONLY && x->s_len > 0) {
+            if (dirty_only)
+                return 1;
+            if (stream_write(x, NULL, 0) == -1)
+                x->werror = 1;
+        }
+    }
+    return 0;
+}
+
+// stream_fill(f, buf, sz)
+//    read more data for stream reader `f`, whose buffer is empty, into
+//    `buf` and then the buffer. Returns the number of bytes that went
+//    to `buf`, or, if `sz == 0`, to the buffer; 0 at end of file.
+static ssize_t stream_fill(io61_file* f, char* buf, size_t sz) {
+    ssize_t r;
+    do {
+        f->s_off = f->s_len = 0;
+        struct iovec iov[2] = { { buf, sz }, { f->sbuf, f->s_cap } };
+        struct iovec* v = sz ? iov : iov + 1;
+        int n = sz ? 2 : 1;
+        r = stream_io(f, v, n, !streams_flush(1));
+        if (r == -1 && errno == EAGAIN) {
+            // about to block: what we wait for may depend on what we wrote
+            streams_flush(0);
+            if (f->s_len > 0)
+                break;
+            r = stream_io(f, v, n, 1);
+        }
+    } while (r == -1 && errno == EINTR);
+    if (f->s_len > 0) {
+        // data arrived while writers flushed
+        size_t n = sz < f->s_len ? sz : f->s_len;
+        memcpy(buf, f->sbuf, n);
+        f->s_off = n;
+        f->pos += n;
+        return sz ? n : f->s_len;
+    }
+    if (r <= 0) {
+        f->eof = (r == 0);
+        return r;
+    }
+    f->f_pos += r;
+    size_t n = (size_t) r < sz ? (size_t) r : sz;
+    f->s_len = r - n;
+    f->pos += n;
+    return sz ? (ssize_t) n : r;
+}
+
+// stream_read(f, buf, sz)
+//    io61_read() for stream reader `f`
+static ssize_t stream_read(io61_file* f, char* buf, size_t sz) {
+    size_t nread = 0;
+    ssize_t r = 0;
+    while (nread != sz) {
+        if (f->s_off < f->s_len) {
+            size_t n = f->s_len - f->s_off;
+            if (n > sz - nread)
+                n = sz - nread;
+            memcpy(buf + nread, f->sbuf + f->s_off, n);
+            f->s_off += n;
+            f->pos += n;
+            nread += n;
+        } else if ((r = stream_fill(f, buf + nread, sz - nread)) <= 0)
+            break;
+        else
+            nread += r;
+    }
+    if (nread == 0 && r == -1 && sz != 0)
+        return -1;
+    return nread;
+}
+
+// direct I/O
+//    Files opened with IO61_DIRECT (O_DIRECT) bypass the page cache and
+//    the block cache. Each gets a DIRECT_BUF transfer buffer, backed by a
+//    huge page where the system has one, from a pool shared by all files.
+//    O_DIRECT needs aligned file offsets, lengths and memory, so reads
+//    fetch whole aligned chunks into the buffer, and an aligned request
+//    into aligned memory skips it. Writes collect in the buffer; whole
+//    blocks go out with O_DIRECT, and the partial blocks at either end of
+//    a flushed range go through the page cache (see direct_flush()).
+
+#define DIRECT_BUF ((size_t) 2 << 20)  // transfer buffer size (a huge page)
+#define DIRECT_POOL 8                   // free buffers kept for reuse
 
-static inline off_t find_block(off_t off) { 
-    return off >> 0xC;
-    //return off/BLOCK_SIZE; 
+static struct {
+    void* free[DIRECT_POOL];
+    int nfree;
+} direct_pool;
+
+// direct_alloc()
+//    return a DIRECT_BUF buffer aligned to DIRECT_BUF, or NULL
+static void* direct_alloc(void) {
+    if (direct_pool.nfree > 0)
+        return direct_pool.free[--direct_pool.nfree];
+    ++stats.misc.n[ST_MAPS];
+    void* p = mmap(NULL, DIRECT_BUF, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+    // no reserved huge pages: map twice the size, keep an aligned
+    // DIRECT_BUF of it, and ask for a transparent huge page
+    ++stats.misc.n[ST_MAPS];
+    char* q = (char*) mmap(NULL, 2 * DIRECT_BUF, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (q == MAP_FAILED)
+        return NULL;
+    char* a = (char*) (((uintptr_t) q + DIRECT_BUF - 1) & ~(DIRECT_BUF - 1));
+    if (a != q) {
+        munmap(q, a - q);
+        ++stats.misc.n[ST_MAPS];
+    }
+    munmap(a + DIRECT_BUF, q + DIRECT_BUF - a);
+    madvise(a, DIRECT_BUF, MADV_HUGEPAGE);
+    ++stats.misc.n[ST_MAPS];
+    ++stats.misc.n[ST_HINTS];
+    return a;
+}
+
+// direct_free(p)
+//    return transfer buffer `p` to the pool
+static void direct_free(void* p) {
+    if (direct_pool.nfree < DIRECT_POOL)
+        direct_pool.free[direct_pool.nfree++] = p;
+    else {
+        munmap(p, DIRECT_BUF);
+        ++stats.misc.n[ST_MAPS];
+    }
+}
+
+// direct_start(f)
+//    set up direct I/O for `f`, whose file descriptor has O_DIRECT; if
+//    that can't be done, turn O_DIRECT off instead
+static void direct_start(io61_file* f) {
+    f->d_align = BLOCK_SIZE;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    ++f->st->n[ST_OTHER];
+    if (statx(f->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+        && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0) {
+        f->d_align = stx.stx_dio_offset_align;
+        if (stx.stx_dio_mem_align > f->d_align)
+            f->d_align = stx.stx_dio_mem_align;
+    }
+#endif
+    f->d_pos = 0;
+    f->d_lo = f->d_hi = 0;
+    if (f->d_align <= DIRECT_BUF && (f->dbuf = (char*) direct_alloc()))
+        return;
+    fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+    f->st->n[ST_OTHER] += 2;
+}
+
+// pwrite_all(f, p, n, pos)
+//    pwrite() all `n` bytes at `p` to `f`
+static int pwrite_all(io61_file* f, const char* p, size_t n, off_t pos) {
+    while (n > 0) {
+        ssize_t r = pwrite(f->fd, p, n, pos);
+        count_io(f, ST_WRITES, r);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+        pos += r;
+    }
+    return 0;
+}
+
+// direct_bounce(f, p, n, pos)
+//    write `n` bytes at `p` to O_DIRECT file `f` at `pos` through the
+//    page cache, for a range that doesn't cover whole blocks
+static int direct_bounce(io61_file* f, const char* p, size_t n, off_t pos) {
+    int flags = fcntl(f->fd, F_GETFL);
+    fcntl(f->fd, F_SETFL, flags & ~O_DIRECT);
+    int r = pwrite_all(f, p, n, pos);
+    fcntl(f->fd, F_SETFL, flags);
+    f->st->n[ST_OTHER] += 3;
+    return r;
+}
+
+// direct_flush(f)
+//    write out O_DIRECT writer `f`'s buffered data and empty the buffer
+static int direct_flush(io61_file* f) {
+    size_t lo = f->d_lo, hi = f->d_hi, a = f->d_align;
+    f->d_lo = f->d_hi = 0;
+    if (lo == hi)
+        return 0;
+    ++f->st->n[ST_FLUSHES];
+    size_t mid_lo = (lo + a - 1) / a * a, mid_hi = hi / a * a;
+    if (mid_lo >= mid_hi)
+        return direct_bounce(f, f->dbuf + lo, hi - lo, f->d_pos + lo);
+    int r = 0;
+    if (lo < mid_lo
+        && direct_bounce(f, f->dbuf + lo, mid_lo - lo, f->d_pos + lo) == -1)
+        r = -1;
+    if (pwrite_all(f, f->dbuf + mid_lo, mid_hi - mid_lo,
+                   f->d_pos + mid_lo) == -1)
+        r = -1;
+    if (mid_hi < hi
+        && direct_bounce(f, f->dbuf + mid_hi, hi - mid_hi,
+                         f->d_pos + mid_hi) == -1)
+        r = -1;
+    return r;
+}
+
+// direct_aligned(f, p, n)
+//    return the part of `n` bytes at `p` and `f`'s position that
+//    O_DIRECT can transfer in place, or 0
+static size_t direct_aligned(io61_file* f, const char* p, size_t n) {
+    if (f->pos % f->d_align != 0 || (uintptr_t) p % f->d_align != 0)
+        return 0;
+    return n - n % f->d_align;
+}
+
+// direct_read(f, buf, sz)
+//    io61_read() for O_DIRECT reader `f`
+static ssize_t direct_read(io61_file* f, char* buf, size_t sz) {
+    size_t nread = 0;
+    ssize_t r = 0;
+    while (nread != sz) {
+        if (f->pos >= f->d_pos && f->pos < f->d_pos + (off_t) f->d_hi) {
+            size_t n = f->d_pos + f->d_hi - f->pos;
+            if (n > sz - nread)
+                n = sz - nread;
+            memcpy(buf + nread, f->dbuf + (f->pos - f->d_pos), n);
+            f->pos += n;
+            nread += n;
+            continue;
+        }
+        size_t n = direct_aligned(f, buf + nread, sz - nread);
+        if (n > 0) {
+            r = pread(f->fd, buf + nread, n, f->pos);
+            count_io(f, ST_READS, r);
+        } else {
+            f->d_pos = f->pos - f->pos % f->d_align;
+            f->d_hi = 0;
+            r = pread(f->fd, f->dbuf, DIRECT_BUF, f->d_pos);
+            count_io(f, ST_READS, r);
+            if (r > 0) {
+                f->d_hi = r;
+                r = f->d_pos + r > f->pos;  // anything for us?
+            }
+        }
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            f->eof = (r == 0);
+            break;
+        }
+        if (n > 0) {
+            f->pos += r;
+            nread += r;
+        }
+    }
+    if (nread == 0 && r == -1 && sz != 0)
+        return -1;
+    return nread;
+}
+
+// direct_write(f, buf, sz)
+//    io61_write() for O_DIRECT writer `f`. The buffer holds one run of
+//    sequential data; writing anywhere else flushes it first.
+static ssize_t direct_write(io61_file* f, const char* buf, size_t sz) {
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        if (f->d_lo != f->d_hi
+            && (f->pos != f->d_pos + (off_t) f->d_hi || f->d_hi == DIRECT_BUF)
+            && direct_flush(f) == -1)
+            break;
+        size_t n = f->d_lo == f->d_hi
+            ? direct_aligned(f, buf + nwritten, sz - nwritten) : 0;
+        if (n > 0) {
+            if (pwrite_all(f, buf + nwritten, n, f->pos) == -1)
+                break;
+        } else {
+            if (f->d_lo == f->d_hi) {
+                f->d_pos = f->pos - f->pos % f->d_align;
+                f->d_lo = f->d_hi = f->pos - f->d_pos;
+            }
+            n = DIRECT_BUF - f->d_hi;
+            if (n > sz - nwritten)
+                n = sz - nwritten;
+            memcpy(f->dbuf + f->d_hi, buf + nwritten, n);
+            f->d_hi += n;
+        }
+        f->pos += n;
+        nwritten += n;
+    }
+    if (nwritten == 0 && sz != 0)
+        return -1;
+    return nwritten;
+}
+
+// io_uring backend
+//    Built with `make DEFS=-DIO61_URING`, cache block reads and writes of
+//    seekable files that nobody waits for right away (read-ahead, flushes,
+//    write-behind) are queued on one io_uring shared by all files and
+//    submitted in batches. Completions are collected lazily: the blocks a
+//    request uses stay pinned until it completes, and only code that needs
+//    a pinned block waits for it (uring_wait()). If the kernel has no
+//    io_uring, files use the ordinary system calls.
+
+#if IO61_URING
+#define URING_ENTRIES 64        // ring size, and max requests in flight
+#define URING_WB 32             // max blocks written behind at once
+#define URING_BATCH 16          // submit once this many requests are queued
+
+typedef struct uring_req {
+    io61_file* f;           // NULL if free
+    int op;                 // IORING_OP_READV or IORING_OP_WRITEV
+    off_t pos;
+    int niov;
+    struct iovec iov[FLUSH_IOV];
+    int nblk;
+    int blk[FLUSH_IOV];     // cache blocks the request uses
+} uring_req;
+
+static struct io61_uring {
+    int fd;                 // -1 if io_uring is unavailable
+    int initialized;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned nqueued;       // requests queued but not submitted
+    int ninflight;          // requests queued or submitted
+    uring_req req[URING_ENTRIES];
+} uring;
+
+// uring_ready(f)
+//    return true if `f`'s blocks can go through the ring
+static int uring_ready(io61_file* f) {
+    if (!uring.initialized) {
+        uring.initialized = 1;
+        uring.fd = -1;
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        ++stats.misc.n[ST_OTHER];
+        if (fd < 0)
+            return 0;
+        size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sqsz = cqsz = sqsz > cqsz ? sqsz : cqsz;
+        char* sq = (char*) mmap(NULL, sqsz, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        char* cq = sq;
+        if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+            cq = (char*) mmap(NULL, cqsz, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQES);
+        stats.misc.n[ST_MAPS] += cq == sq ? 2 : 3;
+        if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+            close(fd);
+            ++stats.misc.n[ST_OTHER];
+            return 0;
+        }
+        uring.sq_tail = (unsigned*) (sq + p.sq_off.tail);
+        uring.sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+        uring.sq_array = (unsigned*) (sq + p.sq_off.array);
+        uring.sqes = (struct io_uring_sqe*) sqes;
+        uring.cq_head = (unsigned*) (cq + p.cq_off.head);
+        uring.cq_tail = (unsigned*) (cq + p.cq_off.tail);
+        uring.cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+        uring.cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+        uring.fd = fd;
+    }
+    return uring.fd >= 0 && f->seekable;
+}
+
+// uring_complete(req, res)
+//    finish request `req`, whose result was `res`
+static void uring_complete(uring_req* req, int res) {
+    io61_file* f = req->f;
+    size_t done = res > 0 ? res : 0;
+    f->st->n[req->op == IORING_OP_READV ? ST_BYTES_READ : ST_BYTES_WRITTEN]
+        += done;
+    if (req->op == IORING_OP_READV)
+        for (int k = 0; k < req->niov; ++k) {
+            size_t take = done < req->iov[k].iov_len ? done : req->iov[k].iov_len;
+            cache.blocks[req->blk[k]].sz += take;
+            done -= take;
+        }
+    else {
+        // finish a short or failed write with ordinary system calls
+        int k = 0;
+        while (k < req->niov && done >= req->iov[k].iov_len) {
+            done -= req->iov[k].iov_len;
+            ++k;
+        }
+        if (k < req->niov) {
+            req->iov[k].iov_base = (char*) req->iov[k].iov_base + done;
+            req->iov[k].iov_len -= done;
+            off_t pos = req->pos + (res > 0 ? res : 0);
+            if (write_run(f, pos, req->iov + k, req->niov - k) == -1)
+                f->werror = 1;
+        }
+    }
+    for (int k = 0; k < req->nblk; ++k)
+        --cache.blocks[req->blk[k]].pin;
+    req->f = NULL;
+    --uring.ninflight;
+}
+
+// uring_enter(wait)
+//    submit queued requests, wait for a completion if `wait`, and
+//    collect all completions
+static void uring_enter(int wait) {
+    if (uring.nqueued > 0 || wait) {
+        int r = syscall(__NR_io_uring_enter, uring.fd, uring.nqueued,
+                        wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                        NULL, 0);
+        ++stats.misc.n[ST_WAITS];
+        if (r > 0)
+            uring.nqueued -= r;
+    }
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+        uring_complete(&uring.req[cqe->user_data], cqe->res);
+        ++head;
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// uring_submit(all)
+//    submit queued requests if there are enough of them, or any if `all`
+static void uring_submit(int all) {
+    if (uring.nqueued >= (all ? 1 : URING_BATCH))
+        uring_enter(0);
+}
+
+// uring_queue(f, op, pos, iov, niov, blk, nblk)
+//    queue a READV or WRITEV request using cache blocks `blk`, which get
+//    pinned until it completes
+static void uring_queue(io61_file* f, int op, off_t pos,
+                        const struct iovec* iov, int niov,
+                        const int* blk, int nblk) {
+    while (uring.ninflight == URING_ENTRIES)
+        uring_enter(1);
+    int ri = 0;
+    while (uring.req[ri].f)
+        ++ri;
+    uring_req* req = &uring.req[ri];
+    req->f = f;
+    req->op = op;
+    ++f->st->n[op == IORING_OP_READV ? ST_READS : ST_WRITES];
+    req->pos = pos;
+    req->niov = niov;
+    memcpy(req->iov, iov, niov * sizeof(*iov));
+    req->nblk = nblk;
+    memcpy(req->blk, blk, nblk * sizeof(*blk));
+    for (int k = 0; k < nblk; ++k)
+        ++cache.blocks[blk[k]].pin;
+    ++uring.ninflight;
+
+    unsigned tail = *uring.sq_tail;
+    unsigned i = tail & *uring.sq_mask;
+    struct io_uring_sqe* sqe = &uring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = f->fd;
+    sqe->off = pos;
+    sqe->addr = (uintptr_t) req->iov;
+    sqe->len = niov;
+    sqe->user_data = ri;
+    uring.sq_array[i] = i;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++uring.nqueued;
+}
+
+// uring_read(f, pos, iov, niov, blk), uring_write(f, pos, iov, niov, blk, nblk)
+//    queue a read into cache blocks `blk[0...niov-1]` (one iovec each), or a
+//    write from cache blocks `blk[0...nblk-1]`
+static void uring_read(io61_file* f, off_t pos, const struct iovec* iov,
+                       int niov, const int* blk) {
+    uring_queue(f, IORING_OP_READV, pos, iov, niov, blk, niov);
+}
+
+static void uring_write(io61_file* f, off_t pos, const struct iovec* iov,
+                        int niov, const int* blk, int nblk) {
+    uring_queue(f, IORING_OP_WRITEV, pos, iov, niov, blk, nblk);
+}
+
+// uring_wait(b)
+//    wait until no request is using cache block `b`
+static void uring_wait(io61_block* b) {
+    while (b->pin > 0 && uring.ninflight > 0)
+        uring_enter(1);
+}
+
+// uring_drain(f)
+//    wait for all of `f`'s requests. Returns -1 if a write failed.
+static int uring_drain(io61_file* f) {
+    for (int ri = 0; ri < URING_ENTRIES; ++ri)
+        while (uring.req[ri].f == f)
+            uring_enter(1);
+    int r = f->werror ? -1 : 0;
+    f->werror = 0;
+    return r;
+}
+
+// uring_writebehind(f)
+//    `f` is about to replace its least recently used block. If that is
+//    dirty, queue it with the next oldest dirty blocks and wait for it
+//    alone, so the blocks replaced after it are already clean.
+static void uring_writebehind(io61_file* f) {
+    if (!uring_ready(f))
+        return;
+    uring_enter(0);
+    io61_block* t = &cache.blocks[f->tail];
+    if (t->ndirty > 0 && !t->pin) {
+        int idx[URING_WB];
+        int n = 0;
+        for (int i = f->tail; i >= 0 && n < URING_WB; i = cache.blocks[i].fprev)
+            if (cache.blocks[i].ndirty > 0 && !cache.blocks[i].pin)
+                idx[n++] = i;
+        qsort(idx, n, sizeof(int), block_compare);
+        flush_blocks(f, idx, n, 1);
+        uring_submit(1);
+        uring_wait(t);
+    }
+}
+
+#else
+static inline int uring_ready(io61_file* f) {
+    (void) f;
+    return 0;
+}
+static inline void uring_submit(int all) {
+    (void) all;
+}
+static inline void uring_read(io61_file* f, off_t pos,
+                              const struct iovec* iov, int niov,
+                              const int* blk) {
+    (void) f, (void) pos, (void) iov, (void) niov, (void) blk;
+}
+static inline void uring_write(io61_file* f, off_t pos,
+                               const struct iovec* iov, int niov,
+                               const int* blk, int nblk) {
+    (void) f, (void) pos, (void) iov, (void) niov, (void) blk, (void) nblk;
+}
+static inline void uring_wait(io61_block* b) {
+    (void) b;
+}
+static inline int uring_drain(io61_file* f) {
+    (void) f;
+    return 0;
+}
+static inline void uring_writebehind(io61_file* f) {
+    (void) f;
+}
+#endif
+
+
+// holes
+//    A regular file can have holes: ranges that take no disk space and
+//    read as zeros. A writer's all-zero blocks become holes if the file
+//    has a hole there already, or ends before them: flush_blocks() skips
+//    them, and io61_flush() extends the file over the ones at its end. A
+//    reader of a file with fewer blocks than bytes looks its holes up with
+//    SEEK_DATA and SEEK_HOLE and zero-fills them instead of reading
+//    (hole_fill()). Mapped reads need none of this, since the kernel maps
+//    holes to its zero page.
+
+#define POS_MAX INT64_MAX
+
+// block_zero(p)
+//    test if the BLOCK_SIZE bytes at `p` are all zero. memcmp() is
+//    vectorized, and a block that starts with data fails at once.
+static inline int block_zero(const unsigned char* p) {
+    return p[0] == 0 && memcmp(p, p + 1, BLOCK_SIZE - 1) == 0;
+}
+
+// hole_end(f, pos)
+//    return the end of the hole at `pos` in `f`: `pos` if there is data
+//    there, POS_MAX if `pos` is at or past end of file. Clears `f->sparse`
+//    if the file system can't tell.
+static off_t hole_end(io61_file* f, off_t pos) {
+    off_t r = lseek(f->fd, pos, SEEK_DATA);
+    ++f->st->n[ST_LSEEKS];
+    if (r != (off_t) -1) {
+        f->f_pos = r;
+        return r;
+    }
+    if (errno == ENXIO)
+        return POS_MAX;
+    f->sparse = 0;
+    return pos;
+}
+
+// hole_fill(f, pos, iov, n)
+//    zero the `n` buffers in `iov`, which are to hold the data of reader
+//    `f` from `pos` on, as far as a hole at `pos` covers them. Returns the
+//    number of bytes zeroed.
+static size_t hole_fill(io61_file* f, off_t pos, const struct iovec* iov,
+                        int n) {
+    if (pos >= f->f_size)
+        return 0;
+    if (pos < f->x_pos || pos >= f->x_end) {
+        off_t end = hole_end(f, pos);
+        if (!f->sparse)
+            return 0;
+        f->x_pos = pos;
+        f->x_hole = end > pos;
+        if (end == pos) {
+            // data: find where it ends, so the next blocks need no lookup
+            end = lseek(f->fd, pos, SEEK_HOLE);
+            ++f->st->n[ST_LSEEKS];
+            if (end == (off_t) -1)
+                end = f->f_size;
+            else
+                f->f_pos = end;
+        }
+        f->x_end = end < f->f_size ? end : f->f_size;
+    }
+    if (!f->x_hole)
+        return 0;
+    size_t left = f->x_end - pos, zeroed = 0;
+    for (int k = 0; k < n && left > 0; ++k) {
+        size_t m = iov[k].iov_len < left ? iov[k].iov_len : left;
+        memset(iov[k].iov_base, 0, m);
+        zeroed += m;
+        left -= m;
+    }
+    f->st->n[ST_HOLES] += (zeroed + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return zeroed;
+}
+
+// hole_extend(f)
+//    make writer `f` long enough to hold the zero blocks flush_blocks()
+//    left as holes at its end
+static int hole_extend(io61_file* f) {
+    if (f->z_end == 0)
+        return 0;
+    struct stat s;
+    int r = fstat(f->fd, &s);
+    ++f->st->n[ST_OTHER];
+    if (r == 0 && s.st_size < f->z_end) {
+        r = ftruncate(f->fd, f->z_end);
+        ++f->st->n[ST_OTHER];
+    }
+    f->z_end = 0;
+    return r;
+}
+
+
+// flush_blocks(f, idx, n, queue)
+//    write the dirty ranges of cached blocks `idx[0...n-1]`, which are in
+//    file order. Ranges that meet across block boundaries go out in one
+//    system call. If `queue` and io_uring is available, the writes are only
+//    submitted, and failures show up in io61_flush(); this is for writes
+//    nobody needs to wait for right away. All-zero blocks over a hole
+//    aren't written at all.
+static int flush_blocks(io61_file* f, const int* idx, int n, int queue) {
+    struct iovec iov[FLUSH_IOV];
+    int blk[FLUSH_IOV];
+    int niov = 0, nblk = 0;
+    off_t run_pos = 0, run_end = 0;
+    off_t hole_pos = 0, hole_to = 0; // [hole_pos, hole_to) is a hole
+    int r = 0;
+    // an appender's writes must land in order
+    int async = queue && !f->append && uring_ready(f);
+    for (int k = 0; k < n; ++k) {
+        io61_block* b = &cache.blocks[idx[k]];
+        if (f->sparse && b->ndirty == 1 && b->dirty_lo[0] == 0
+            && b->dirty_hi[0] == BLOCK_SIZE && block_zero(b->buf)) {
+            if (b->pos < hole_pos || b->pos >= hole_to) {
+                hole_pos = b->pos;
+                hole_to = hole_end(f, b->pos);
+            }
+            if (b->pos + BLOCK_SIZE <= hole_to) {
+                if (b->pos + BLOCK_SIZE > f->z_end)
+                    f->z_end = b->pos + BLOCK_SIZE;
+                ++f->st->n[ST_HOLES];
+                continue;
+            }
+        }
+        for (int d = 0; d < b->ndirty; ++d) {
+            off_t lo = b->pos + b->dirty_lo[d];
+            if (niov > 0 && (lo != run_end || niov == FLUSH_IOV)) {
+                if (async)
+                    uring_write(f, run_pos, iov, niov, blk, nblk);
+                else if (write_run(f, run_pos, iov, niov) == -1)
+                    r = -1;
+                niov = nblk = 0;
+            }
+            if (niov == 0)
+                run_pos = lo;
+            if (nblk == 0 || blk[nblk - 1] != idx[k])
+                blk[nblk++] = idx[k];
+            iov[niov].iov_base = b->buf + b->dirty_lo[d];
+            iov[niov].iov_len = b->dirty_hi[d] - b->dirty_lo[d];
+            ++niov;
+            run_end = b->pos + b->dirty_hi[d];
+        }
+    }
+    if (niov > 0) {
+        ++f->st->n[ST_FLUSHES];
+        if (async) {
+            uring_write(f, run_pos, iov, niov, blk, nblk);
+            uring_submit(0);
+        } else if (write_run(f, run_pos, iov, niov) == -1)
+            r = -1;
+    }
+    if (r == 0)
+        for (int k = 0; k < n; ++k)
+            cache.blocks[idx[k]].ndirty = 0;
+    return r;
+}
+
+// flush_block(f, b, queue)
+//    write the dirty ranges of cached block `b` to disk/device
+static int flush_block(io61_file* f, io61_block* b, int queue) {
+    if (b->ndirty == 0)
+        return 0;
+    int i = b - cache.blocks;
+    return flush_blocks(f, &i, 1, queue);
+}
+
+// flush_around(f, i, queue)
+//    write back cached block `i` if dirty, together with the dirty
+//    neighbors its data runs into (write-behind). `queue` is as for
+//    flush_blocks().
+static int flush_around(io61_file* f, int i, int queue) {
+    if (cache.blocks[i].ndirty == 0)
+        return 0;
+    int run[2 * WB_RUN + 1];
+    int lo = WB_RUN, hi = WB_RUN + 1;
+    run[lo] = i;
+    while (lo > 0) {
+        io61_block* x = &cache.blocks[run[lo]];
+        int j = x->dirty_lo[0] == 0 ? cache_lookup(f, x->block - 1) : -1;
+        if (j < 0 || cache.blocks[j].ndirty == 0
+            || cache.blocks[j].dirty_hi[cache.blocks[j].ndirty - 1] != BLOCK_SIZE)
+            break;
+        run[--lo] = j;
+    }
+    while (hi < 2 * WB_RUN + 1) {
+        io61_block* x = &cache.blocks[run[hi - 1]];
+        int j = x->dirty_hi[x->ndirty - 1] == BLOCK_SIZE
+            ? cache_lookup(f, x->block + 1) : -1;
+        if (j < 0 || cache.blocks[j].ndirty == 0
+            || cache.blocks[j].dirty_lo[0] != 0)
+            break;
+        run[hi++] = j;
+    }
+    return flush_blocks(f, run + lo, hi - lo, queue);
+}
+
+// dirty_add(b, lo, hi)
+//    mark [lo, hi) of cached block `b` dirty. Returns -1 if that would
+//    need more than DIRTY_RANGES separate ranges.
+static int dirty_add(io61_block* b, int lo, int hi) {
+    // ranges [k, j) overlap or touch [lo, hi)
+    int k = 0;
+    while (k < b->ndirty && b->dirty_hi[k] < lo)
+        ++k;
+    int j = k;
+    while (j < b->ndirty && b->dirty_lo[j] <= hi)
+        ++j;
+    if (j == k) {
+        if (b->ndirty == DIRTY_RANGES)
+            return -1;
+        memmove(&b->dirty_lo[k + 1], &b->dirty_lo[k],
+                (b->ndirty - k) * sizeof(b->dirty_lo[0]));
+        memmove(&b->dirty_hi[k + 1], &b->dirty_hi[k],
+                (b->ndirty - k) * sizeof(b->dirty_hi[0]));
+        ++b->ndirty;
+    } else {
+        if (b->dirty_lo[k] < lo)
+            lo = b->dirty_lo[k];
+        if (b->dirty_hi[j - 1] > hi)
+            hi = b->dirty_hi[j - 1];
+        memmove(&b->dirty_lo[k + 1], &b->dirty_lo[j],
+                (b->ndirty - j) * sizeof(b->dirty_lo[0]));
+        memmove(&b->dirty_hi[k + 1], &b->dirty_hi[j],
+                (b->ndirty - j) * sizeof(b->dirty_hi[0]));
+        b->ndirty -= j - k - 1;
+    }
+    b->dirty_lo[k] = lo;
+    b->dirty_hi[k] = hi;
+    return 0;
+}
+
+// buffer_write(f, b, ofs, buf, sz)
+//    copy `sz` bytes into cached block `b` at offset `ofs`
+static int buffer_write(io61_file* f, io61_block* b, int ofs,
+                        const char* buf, size_t sz) {
+    uring_wait(b);
+    if (f->mode == O_RDWR) {
+        // the block holds all its data, so it grows like the file, and
+        // dirty ranges can always merge into one
+        if (ofs > b->sz)
+            memset(b->buf + b->sz, 0, ofs - b->sz);
+        if (ofs + (ssize_t) sz > b->sz)
+            b->sz = ofs + sz;
+        if (b->pos + b->sz > f->f_size)
+            f->f_size = b->pos + b->sz;
+        if (dirty_add(b, ofs, ofs + sz) == -1) {
+            if (ofs < b->dirty_lo[0])
+                b->dirty_lo[0] = ofs;
+            if (ofs + (int) sz > b->dirty_hi[b->ndirty - 1])
+                b->dirty_hi[0] = ofs + sz;
+            else
+                b->dirty_hi[0] = b->dirty_hi[b->ndirty - 1];
+            b->ndirty = 1;
+        }
+    } else if (dirty_add(b, ofs, ofs + sz) == -1) {
+        // only the dirty ranges hold valid data in a write-only file, so a
+        // block with too many of them is written out first
+        if (flush_block(f, b, 0) == -1)
+            return -1;
+        dirty_add(b, ofs, ofs + sz);
+    }
+    memcpy(b->buf + ofs, buf, sz);
+    // sequential writers hand their blocks to the kernel a run at a time,
+    // when the last block of a run fills
+    if (f->pattern == IO61_SEQUENTIAL && ofs + sz == BLOCK_SIZE) {
+        int limit = file_limit(f);
+        if ((b->block + 1) % limit == 0) {
+            int r = flush_around(f, b - cache.blocks, 1);
+            run_tune(f, (size_t) limit * BLOCK_SIZE);
+            return r;
+        }
+    }
+    return 0;
+}
+
+// read_blocks(f, first, n, target)
+//    read blocks [first, first + n) of `f`, none of which is cached, with
+//    one system call, and return block `target` among them. Blocks that
+//    get no data are dropped again, except `target`.
+static io61_block* read_blocks(io61_file* f, off_t first, int n, off_t target) {
+    int idx[RUN_MAX];
+    struct iovec iov[RUN_MAX];
+    if (f->limit < n + 1)
+        f->limit = n + 1;
+    // allocate the block needed soonest last, so it is replaced last
+    for (int k = 0; k < n; ++k) {
+        int j = f->pattern == IO61_REVERSE ? k : n - 1 - k;
+        idx[j] = cache_alloc(f, first + j);
+        cache.blocks[idx[j]].pin = 1;
+    }
+    io61_block* b0 = &cache.blocks[idx[0]];
+    // a pipe may already be past the block start (after a direct
+    // read); the bytes before that are never looked at
+    if (!f->seekable && f->f_pos > b0->pos)
+        b0->sz = f->f_pos - b0->pos;
+    for (int k = 0; k < n; ++k) {
+        io61_block* b = &cache.blocks[idx[k]];
+        iov[k].iov_base = b->buf + b->sz;
+        iov[k].iov_len = BLOCK_SIZE - b->sz;
+    }
+
+    off_t pos = b0->pos + b0->sz;
+    if (n > 1 && f->mode == O_RDONLY && uring_ready(f)) {
+        // wait only for the target block; the rest arrive in the background
+        int t = target - first;
+        int a0 = t == 0 ? 1 : 0;
+        for (int k = 0; k < n; ++k)
+            cache.blocks[idx[k]].pin = 0;
+        uring_read(f, cache.blocks[idx[t]].pos, &iov[t], 1, &idx[t]);
+        uring_read(f, cache.blocks[idx[a0]].pos, &iov[a0], n - 1, &idx[a0]);
+        for (int k = 0; k < n; ++k)
+            cache.blocks[idx[k]].ahead = k != t;
+        f->st->n[ST_PREFETCHED] += n - 1;
+        io61_block* tb = &cache.blocks[idx[t]];
+        uring_wait(tb);
+        if (tb->sz == 0)
+            f->eof = 1;
+        cache_touch(f, idx[t]);
+        return tb;
+    }
+    ssize_t r = 0;
+    if (f->f_size == -1 || pos < f->f_size) {
+        // a hole at `pos` is zero-filled and the data after it read
+        size_t zeroed = f->sparse ? hole_fill(f, pos, iov, n) : 0;
+        struct iovec v[RUN_MAX];
+        struct iovec* vp = v;
+        memcpy(v, iov, n * sizeof(*iov));
+        int nv = iov_advance(&vp, n, zeroed);
+        if (nv > 0 && (f->f_size == -1 || pos + (off_t) zeroed < f->f_size))
+            do {
+                if (f->seekable) {
+                    r = preadv(f->fd, vp, nv, pos + zeroed);
+                    count_io(f, ST_READS, r);
+                } else
+                    r = stream_readv(f, vp, nv);
+            } while (r == -1 && errno == EINTR);
+        if (zeroed > 0)
+            r = (r > 0 ? r : 0) + zeroed;
+    }
+    if (r == 0)
+        f->eof = 1;
+    if (r > 0 && !f->seekable)
+        f->f_pos += r;
+
+    int ti = -1;
+    for (int k = 0; k < n; ++k) {
+        io61_block* b = &cache.blocks[idx[k]];
+        size_t take = r > 0 ? (size_t) r : 0;
+        if (take > iov[k].iov_len)
+            take = iov[k].iov_len;
+        b->sz += take;
+        r -= take;
+        if (f->mode == O_RDWR)
+            rw_pad(f, b);
+        b->pin = 0;
+        if (first + k == target)
+            ti = idx[k];
+        else if (b->sz == 0)
+            cache_unlink(idx[k]);
+        else {
+            b->ahead = 1;
+            ++f->st->n[ST_PREFETCHED];
+        }
+    }
+    cache_touch(f, ti);
+    return &cache.blocks[ti];
+}
+
+// read_ahead(f, block)
+//    read uncached block `block` of `f`, with neighbors the access
+//    pattern says will be needed soon
+static io61_block* read_ahead(io61_file* f, off_t block) {
+    int seqlike = f->pattern == IO61_SEQUENTIAL
+        || (f->pattern == IO61_STRIDED && f->stride < BLOCK_SIZE);
+    off_t last = f->f_size == -1 ? (off_t) -1 >> 1 : find_block(f->f_size - 1);
+    off_t first = block;
+    int n = 1;
+    if (seqlike || (f->pattern == IO61_REVERSE && f->seekable)) {
+        int want = f->ra < f->run ? f->ra : f->run;
+        if (f->ra < f->run)
+            f->ra *= 2;
+        if (seqlike)
+            while (n < want && block + n <= last && cache_lookup(f, block + n) < 0)
+                ++n;
+        else
+            while (n < want && first > 0 && cache_lookup(f, first - 1) < 0) {
+                --first;
+                ++n;
+            }
+    } else if (f->pattern == IO61_STRIDED && f->seekable) {
+        // ask the kernel to start on the access PREFETCH_DEPTH strides on
+        off_t ahead = block * BLOCK_SIZE + PREFETCH_DEPTH * f->stride;
+        if (ahead >= 0 && (f->f_size == -1 || ahead < f->f_size)) {
+            posix_fadvise(f->fd, ahead, BLOCK_SIZE, POSIX_FADV_WILLNEED);
+            ++f->st->n[ST_HINTS];
+        }
+    }
+    io61_block* b = read_blocks(f, first, n, block);
+    if (seqlike && n == f->run)
+        run_tune(f, (size_t) n * BLOCK_SIZE);
+    return b;
+}
+
+// find_block_data(f, block, whole)
+//    return the cached block for `f`'s block `block`, reading it in if
+//    necessary (read mode, and read/write mode unless the caller will
+//    overwrite the `whole` block)
+static io61_block* find_block_data(io61_file* f, off_t block, int whole) {
+    int i = cache_lookup(f, block);
+    if (i >= 0) {
+        if (i != f->cur)
+            cache_touch(f, i);
+        uring_wait(&cache.blocks[i]);
+        cache_hit(f, &cache.blocks[i]);
+        return &cache.blocks[i];
+    }
+    ++f->st->n[ST_MISSES];
+    detect_miss(f);
+    if (f->mode == O_RDONLY || (f->mode == O_RDWR && !whole))
+        return read_ahead(f, block);
+    return &cache.blocks[cache_alloc(f, block)];
+}
+
+
+
+// memory-mapped reads
+//    Read-only regular files are served from a read-only mapping instead
+//    of the block cache. Files bigger than MAP_WINDOW are mapped one window
+//    at a time; the window slides to wherever the file position goes (see
+//    map_covers() for when it doesn't).
+
+#ifndef MAP_WINDOW
+#define MAP_WINDOW ((size_t) 64 << 20)
+#endif
+
+// map_window(f, pos)
+//    map the window of `f` that contains `pos`, which must be < f->f_size
+static int map_window(io61_file* f, off_t pos) {
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = 0;
+    if ((off_t) MAP_WINDOW < f->f_size) {
+        if (f->map && pos < f->map_pos) {
+            // moving backwards: keep `pos` near the end of the window
+            start = ((pos + page) & ~(page - 1)) - (off_t) MAP_WINDOW;
+            if (start < 0)
+                start = 0;
+        } else
+            start = pos & ~(page - 1);
+    }
+    size_t sz = MAP_WINDOW;
+    if ((off_t) sz > f->f_size - start)
+        sz = f->f_size - start;
+
+    if (f->map) {
+        munmap(f->map, f->map_sz);
+        ++f->st->n[ST_MAPS];
+    }
+    void* p = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, f->fd, start);
+    ++f->st->n[ST_MAPS];
+    if (p == MAP_FAILED) {
+        f->map = NULL;
+        return -1;
+    }
+    f->map = (unsigned char*) p;
+    f->map_pos = start;
+    f->map_sz = sz;
+    madvise(f->map, f->map_sz, f->map_advice);
+    ++f->st->n[ST_HINTS];
+    if (f->pattern == IO61_STRIDED && f->stride >= BLOCK_SIZE) {
+        madvise(f->map, f->map_sz, MADV_WILLNEED);
+        ++f->st->n[ST_HINTS];
+    }
+    return 0;
+}
+
+// map_advise(f, advice)
+//    change the kernel's read-ahead hint for `f`'s mapping
+static void map_advise(io61_file* f, int advice) {
+    if (f->map && f->map_advice != advice) {
+        madvise(f->map, f->map_sz, advice);
+        ++f->st->n[ST_HINTS];
+    }
+    f->map_advice = advice;
+}
+
+// map_covers(f, pos)
+//    return true if `pos` (< f->f_size) can be read from `f`'s mapping,
+//    sliding the window there if needed. Strided and random accesses that
+//    leave the window go through the block cache instead, since they would
+//    move the window far more often than they use it.
+static int map_covers(io61_file* f, off_t pos) {
+    if ((uint64_t) (pos - f->map_pos) < f->map_sz)
+        return 1;
+    if (f->pattern == IO61_RANDOM
+        || (f->pattern == IO61_STRIDED && f->stride >= BLOCK_SIZE))
+        return 0;
+    return map_window(f, pos) == 0;
+}
+
+
+// access-pattern detector
+//    Each io61_seek() that moves the file position is compared with the
+//    previous one: the same jump twice is a fixed stride (a negative one is
+//    a reverse scan), anything else is random. Reaching a new block (or
+//    reading a mapping) without seeking since the last time is sequential.
+//    A pattern takes effect once two accesses in a row agree on it and is
+//    re-evaluated on every access, so a file can change patterns any time.
+//    The pattern picks read-ahead, kernel hints and write-behind.
+
+// pattern_changed(f)
+//    pass `f`'s new access pattern on to the kernel
+static void pattern_changed(io61_file* f) {
+    int seqlike = f->pattern == IO61_SEQUENTIAL
+        || (f->pattern == IO61_STRIDED && f->stride < BLOCK_SIZE);
+    f->ra = 1;
+    f->ra_mark = f->pos;
+    // a seeking writer may fill in its blocks over many passes; keeping
+    // them lets the pieces go out together
+    if (f->mode != O_RDONLY && f->pattern != IO61_SEQUENTIAL)
+        f->limit = CACHE_BLOCKS;
+    if (f->map) {
+        if (seqlike)
+            map_advise(f, MADV_SEQUENTIAL);
+        else if (f->pattern == IO61_RANDOM)
+            map_advise(f, MADV_RANDOM);
+        else
+            map_advise(f, MADV_NORMAL);
+    } else if (f->seekable && f->mode != O_WRONLY) {
+        posix_fadvise(f->fd, 0, 0, seqlike ? POSIX_FADV_SEQUENTIAL
+                      : f->pattern == IO61_RANDOM ? POSIX_FADV_RANDOM
+                      : POSIX_FADV_NORMAL);
+        ++f->st->n[ST_HINTS];
+    }
+    if (f->pattern == IO61_STRIDED && !seqlike && f->mode != O_WRONLY
+        && f->seekable)
+        for (int k = 1; k <= PREFETCH_DEPTH; ++k) {
+            off_t ahead = f->pos + k * f->stride;
+            if (ahead < 0 || (f->f_size != -1 && ahead >= f->f_size))
+                break;
+            if (f->map && (uint64_t) (ahead - f->map_pos) < f->map_sz) {
+                off_t page = (ahead - f->map_pos) & ~(sysconf(_SC_PAGESIZE) - 1);
+                madvise(f->map + page, 1, MADV_WILLNEED);
+            } else
+                posix_fadvise(f->fd, ahead, BLOCK_SIZE, POSIX_FADV_WILLNEED);
+            ++f->st->n[ST_HINTS];
+        }
+}
+
+// detect_vote(f, pattern, stride)
+//    record that the latest access looks like `pattern`
+static void detect_vote(io61_file* f, int pattern, off_t stride) {
+    if (pattern != f->cand || stride != f->cand_stride) {
+        f->cand = pattern;
+        f->cand_stride = stride;
+        f->votes = 0;
+    }
+    if (f->votes < 2)
+        ++f->votes;
+    if (f->votes == 2 && (pattern != f->pattern || stride != f->stride)) {
+        f->pattern = pattern;
+        f->stride = stride;
+        pattern_changed(f);
+    }
+}
+
+// detect_seek(f, pos)
+//    `f` is about to move to `pos`
+static void detect_seek(io61_file* f, off_t pos) {
+    ++f->nseeks;
+    off_t delta = pos - f->last_start;
+    // going back to where the last access started (to rewrite what was
+    // just read) says nothing about the pattern
+    if (delta == 0)
+        return;
+    // one odd jump (a stride wrapping around) doesn't end a stride
+    if (delta == f->last_delta
+        || ((f->pattern == IO61_STRIDED || f->pattern == IO61_REVERSE)
+            && delta == f->stride))
+        detect_vote(f, delta < 0 ? IO61_REVERSE : IO61_STRIDED, delta);
+    else
+        detect_vote(f, IO61_RANDOM, 0);
+    f->last_start = pos;
+    f->last_delta = delta;
+
+    // the kernel doesn't read ahead backwards in a mapping; do it for it
+    if (f->pattern == IO61_REVERSE && f->map && pos < f->ra_mark
+        && pos >= f->map_pos) {
+        off_t page = sysconf(_SC_PAGESIZE);
+        off_t lo = pos - RA_MAX * BLOCK_SIZE;
+        if (lo < f->map_pos)
+            lo = f->map_pos;
+        lo &= ~(page - 1);
+        madvise(f->map + (lo - f->map_pos), pos + 1 - lo, MADV_WILLNEED);
+        ++f->st->n[ST_HINTS];
+        f->ra_mark = pos - RA_MAX * BLOCK_SIZE / 2;
+    }
+}
+
+// detect_miss(f)
+//    `f` needs data it hasn't buffered
+static void detect_miss(io61_file* f) {
+    if (f->nseeks == f->miss_seeks)
+        detect_vote(f, IO61_SEQUENTIAL, 0);
+    f->miss_seeks = f->nseeks;
+}
+
+
+// stats_open(f)
+//    give new file `f` its counters, named after its file descriptor
+static void stats_open(io61_file* f) {
+    if (stats.nfiles < STATS_FILES) {
+        f->st = &stats.file[stats.nfiles];
+        if (f->fd <= STDERR_FILENO)
+            strcpy(f->st->name, f->fd == STDIN_FILENO ? "stdin"
+                   : f->fd == STDOUT_FILENO ? "stdout" : "stderr");
+        else
+            snprintf(f->st->name, sizeof(f->st->name), "fd %d", f->fd);
+    } else {
+        f->st = &stats.file[STATS_FILES - 1];
+        strcpy(f->st->name, "(others)");
+    }
+    ++stats.nfiles;
+    f->seek_owed = 0;
+}
+
+// stats_name(f, name)
+//    name `f`'s counters after file `name`, unless they are shared
+static void stats_name(io61_file* f, const char* name) {
+    if (strcmp(f->st->name, "(others)") == 0)
+        return;
+    size_t n = 0;
+    for (; *name && n + 3 < sizeof(f->st->name); ++name) {
+        if (*name == '"' || *name == '\\')
+            f->st->name[n++] = '\\';
+        f->st->name[n++] = (unsigned char) *name < ' ' ? '?' : *name;
+    }
+    f->st->name[n] = '\0';
+}
+
+
+// io61_fdopen(fd, mode)
+//    Return a new io61_file for file descriptor `fd`. `mode` is
+//    either O_RDONLY for a read-only file, O_WRONLY for a
+//    write-only file, or O_RDWR for a seekable read/write file.
+
+io61_file* io61_fdopen(int fd, int mode) {
+    assert(fd >= 0);
+    if (!cache.initialized)
+        cache_init();
+    io61_file* f = (io61_file*) malloc(sizeof(io61_file));
+    f->fd = fd;
+    f->mode = mode;
+    stats_open(f);
+    assert(mode == O_RDONLY || mode == O_WRONLY || mode == O_RDWR);
+    // an inherited fd may be partway through its file: start there, so
+    // positional I/O and write() agree on where the data goes. An
+    // appender's data goes to the end, so start there instead.
+    int fl = fcntl(fd, F_GETFL);
+    ++f->st->n[ST_OTHER];
+    f->append = mode != O_RDONLY && fl != -1 && (fl & O_APPEND);
+    f->pos = lseek(fd, 0, f->append ? SEEK_END : SEEK_CUR);
+    ++f->st->n[ST_LSEEKS];
+    f->seekable = f->pos != (off_t) -1;
+    if (!f->seekable)
+        f->pos = 0;
+    f->f_pos = f->pos;
+    assert(mode != O_RDWR || f->seekable);
+    struct stat s;
+    int sr = fstat(fd, &s);
+    ++f->st->n[ST_OTHER];
+    f->f_size = sr == 0 && S_ISREG(s.st_mode) ? s.st_size : -1;
+    // a reader's file has holes if it has fewer blocks than bytes. A
+    // read/write file's holes would fill under hole_fill()'s feet, and an
+    // appender can't skip a block, since its writes land wherever the end
+    // is.
+    f->sparse = f->f_size >= 0
+        && ((mode == O_WRONLY && !f->append)
+            || (mode == O_RDONLY && (off_t) s.st_blocks * 512 < f->f_size));
+    f->x_pos = f->x_end = 0;
+    f->x_hole = 0;
+    f->z_end = 0;
+    f->lz = NULL;
+    f->eof = 0;
+    f->pattern = f->cand = IO61_SEQUENTIAL;
+    f->stride = f->cand_stride = 0;
+    f->votes = 2;
+    f->last_start = f->last_delta = 0;
+    f->nseeks = f->miss_seeks = 0;
+    f->ra = 1;
+    f->ra_mark = 0;
+    // runs start at the file system's preferred I/O size, if that's more;
+    // a reader too small for a few samples has nothing to tune
+    f->run = RA_MAX;
+    if (sr == 0 && s.st_blksize / BLOCK_SIZE > RA_MAX)
+        f->run = s.st_blksize / BLOCK_SIZE < RUN_MAX
+            ? s.st_blksize / BLOCK_SIZE : RUN_MAX;
+    f->run_done = mode == O_RDONLY && f->f_size >= 0
+        && f->f_size < (off_t) (4 * RUN_SAMPLE);
+    f->run_n = 0;
+    f->run_bytes = 0;
+    f->run_t0 = 0;
+    f->run_rate = -1;
+    f->cur = f->head = f->tail = -1;
+    f->nblocks = 0;
+    f->limit = CACHE_SEQ_LIMIT;
+    for (int i = 0; i < NGHOSTS; ++i)
+        f->ghosts[i] = -1;
+    f->ghost_i = 0;
+    f->map = NULL;
+    f->map_advice = MADV_SEQUENTIAL;
+    f->dbuf = NULL;
+    f->shared = NULL;
+    f->lbuf = NULL;
+    f->lbuf_sz = 0;
+    f->line_blk = -1;
+    f->c.r = f->c.r_end = f->c.w = f->c.w_end = NULL;
+    f->c_start = f->c_lo = NULL;
+    f->c_blk = -1;
+    if (f->seekable && fl != -1) {
+        // a read/write file goes through the block cache, which
+        // O_DIRECT's alignment rules don't suit
+        if ((fl & O_DIRECT) && mode == O_RDWR) {
+            fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+            ++f->st->n[ST_OTHER];
+        } else if (fl & O_DIRECT)
+            direct_start(f);
+    }
+    if (mode == O_RDONLY && f->f_size > 0 && !f->dbuf)
+        map_window(f, f->pos);
+    f->werror = 0;
+    async_start(f);
+    f->sbuf = NULL;
+    f->s_off = f->s_len = 0;
+    f->s_pin = 0;
+    f->nowait = !f->async;
+    if (!f->seekable) {
+        f->s_cap = STREAM_BUF;
+        if (sr == 0 && S_ISFIFO(s.st_mode)) {
+            int cap = fcntl(fd, F_GETPIPE_SZ);
+            ++f->st->n[ST_OTHER];
+            if (cap > RUN_MAX * BLOCK_SIZE)
+                cap = RUN_MAX * BLOCK_SIZE;
+            if (cap >= BLOCK_SIZE)
+                f->s_cap = cap;
+        } else if (sr == 0 && S_ISCHR(s.st_mode)) {
+            ++f->st->n[ST_OTHER];
+            if (isatty(fd))
+                f->s_cap = BLOCK_SIZE;
+        }
+        f->sbuf = (char*) malloc(f->s_cap);
+        f->snext = streams;
+        streams = f;
+    }
+    ++cache.nfiles;
+    return f;
+}
+
+
+// io61_close(f)
+//    Close the io61_file `f` and release all its resources. Returns -1 if
+//    writing out buffered data failed, as well as if close() did.
+
+int io61_close(io61_file* f) {
+    if (f->lz)
+        return lz_close(f);
+    cursor_close(f);
+    line_unpin(f);
+    free(f->lbuf);
+    // most write errors only show up here, when the cache is written back
+    int r = io61_flush(f);
+    async_stop(f);
+    if (cache_release(f) == -1)
+        r = -1;
+    if (uring_drain(f) == -1)
+        r = -1;
+    if (f->map) {
+        munmap(f->map, f->map_sz);
+        ++f->st->n[ST_MAPS];
+    }
+    shared_free(f);
+    if (f->dbuf)
+        direct_free(f->dbuf);
+    if (f->sbuf) {
+        io61_file** pp = &streams;
+        while (*pp != f)
+            pp = &(*pp)->snext;
+        *pp = f->snext;
+        free(f->sbuf);
+    }
+    if (close(f->fd) == -1)
+        r = -1;
+    ++f->st->n[ST_OTHER];
+    if (f->seek_owed)
+        ++f->st->n[ST_SEEKS_ELIDED];
+    --cache.nfiles;
+    free(f);
+    return r;
+}
+
+
+
+// checksums
+//    CRC-32C (Castagnoli), which x86-64 computes 8 bytes per instruction
+//    with SSE4.2. Other machines use a table a byte at a time.
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_update)(uint32_t, const unsigned char*, size_t);
+
+// crc32c_soft(crc, p, n), crc32c_sse42(crc, p, n)
+//    return raw (uninverted) CRC-32C `crc` updated with `n` bytes at `p`
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char* p, size_t n) {
+    for (size_t i = 0; i != n; ++i)
+        crc = crc32c_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c = _mm_crc32_u64(c, x);
+    }
+    for (; n != 0; ++p, --n)
+        c = _mm_crc32_u8(c, *p);
+    return c;
+}
+#endif
+
+// crc32c_init()
+//    choose how to compute checksums; called before any thread needs one
+static void crc32c_init(void) {
+    if (crc32c_update)
+        return;
+    for (uint32_t i = 0; i != 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k != 8; ++k)
+            c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+        crc32c_table[i] = c;
+    }
+    crc32c_update = crc32c_soft;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_sse42;
+#endif
+}
+
+// crc32c(p, n)
+//    return the CRC-32C of the `n` bytes at `p`
+static uint32_t crc32c(const unsigned char* p, size_t n) {
+    return ~crc32c_update(~0U, p, n);
+}
+
+
+
+// compressed files
+//    io61_open_check() with IO61_COMPRESS reads or writes a framed,
+//    block-compressed file. The io61_file it returns keeps the position in
+//    the uncompressed data, and a second io61_file (`raw`) moves the
+//    compressed bytes. The data is cut into LZ_BLOCK blocks compressed on
+//    their own, so any block decodes without the others. The file is
+//        header:  "IO61LZ1\n", block size (4 bytes), flags (4 bytes)
+//        blocks:  data size (4), stored size (4), [checksum (4)], stored
+//                 bytes, which are the data itself if the sizes are equal
+//        end:     0 (4), number of blocks (4), [checksum (4)]
+//        index:   file offset of each block (8 each)
+//        trailer: data size (8), index offset (8), "IO61LZX\n"
+//    with numbers little-endian. A reader of a seekable file loads the
+//    index at open, so io61_seek() anywhere costs nothing and the next read
+//    decodes one block; other readers go block by block to the end marker.
+//    A writer fills blocks in a ring of LZ_SLOTS buffers, which a thread
+//    compresses; the writer itself writes the finished blocks out in order
+//    as it needs slots, so every io61 call stays on the caller's thread.
+//    Only the last block may be short, so io61_flush() waits for the
+//    thread but keeps a partial block; io61_close() writes it.
+//    With IO61_CHECKSUM, flag LZ_CRC is set and each block header carries
+//    the CRC-32C of the block's data, which a reader checks as it decodes
+//    the block. The end marker carries the CRC-32C of all the blocks'
+//    checksums in order, so a reader that goes block by block also sees a
+//    block that went missing. IO61_CHECKSUM without IO61_COMPRESS stores
+//    every block as is.
+
+#define LZ_BLOCK 0x10000        // uncompressed block size
+#define LZ_SLOTS 4              // blocks a writer can queue
+#define LZ_HASH_BITS 13         // match finder table size
+#define LZ_MIN_MATCH 4
+#define LZ_HEADER 16
+#define LZ_BLOCK_HEADER 8       // plus 4 with LZ_CRC
+#define LZ_TRAILER 24
+#define LZ_CRC 1                // header flag: blocks have checksums
+
+static const char lz_magic[8] = "IO61LZ1\n";
+static const char lz_trailer_magic[8] = "IO61LZX\n";
+
+typedef struct io61_lz {
+    io61_file* raw;         // the compressed file
+    unsigned char* buf;     // reader: block `blk`, decoded, `len` bytes
+    size_t len;
+    off_t blk;              // -1 before the first block
+    unsigned char* packed;  // reader: a block as stored
+    uint64_t* index;        // block offsets (reader: and the end marker's
+    off_t nblocks;          // last), or NULL for a reader without one
+    size_t index_cap;       // writer: room in `index`
+    off_t size;             // reader: data size, or -1
+    int done;               // reader: saw the end marker
+    pthread_t thread;       // writer: compression thread
+    unsigned char* slot[LZ_SLOTS]; // writer: blocks, and the data in them
+    size_t slot_len[LZ_SLOTS];     // (0 tells the thread to stop)
+    unsigned char* out[LZ_SLOTS];  // writer: the blocks as stored
+    unsigned head;          // slots handed to the thread
+    unsigned tail;          // slots the thread has compressed
+    unsigned written;       // slots written out (writer only)
+    int held;               // writer is filling slot `head`
+    pthread_mutex_t lock;   // protects `head` and `tail`
+    pthread_cond_t filled;  // signalled when `head` moves
+    pthread_cond_t drained; // signalled when `tail` moves
+    off_t raw_pos;          // writer: offset of the next block
+    int error;              // writer: a write failed
+    int crc;                // blocks have checksums (LZ_CRC)
+    int compress;           // writer: compress blocks
+    size_t bh;              // block header size
+    uint32_t sum;           // raw CRC-32C of the block checksums so far
+} io61_lz;
+
+// lz_put(p, x, n), lz_get(p, n)
+//    store or load `n`-byte little-endian number `x` at `p`
+static void lz_put(unsigned char* p, uint64_t x, int n) {
+    for (int i = 0; i < n; ++i)
+        p[i] = x >> (8 * i);
+}
+static uint64_t lz_get(const unsigned char* p, int n) {
+    uint64_t x = 0;
+    for (int i = n - 1; i >= 0; --i)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+// lz_usec()
+//    return a monotonic time in microseconds, for the codec counters
+static unsigned long long lz_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// lz_sequence(op, oend, lit, nlit, off, mlen)
+//    append a sequence to the output at `*op`: `nlit` literals from `lit`,
+//    then a match `off` bytes back, `mlen + LZ_MIN_MATCH` long; the last
+//    sequence has no match (`off == 0`). Returns 0 if it doesn't fit
+//    before `oend`.
+static int lz_sequence(unsigned char** op, unsigned char* oend,
+                       const unsigned char* lit, size_t nlit,
+                       size_t off, size_t mlen) {
+    unsigned char* p = *op;
+    if ((size_t) (oend - p) < nlit + nlit / 255 + mlen / 255 + 5)
+        return 0;
+    unsigned char* token = p++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15) {
+        size_t x = nlit - 15;
+        for (; x >= 255; x -= 255)
+            *p++ = 255;
+        *p++ = x;
+    }
+    memcpy(p, lit, nlit);
+    p += nlit;
+    if (off) {
+        *p++ = off;
+        *p++ = off >> 8;
+        *token |= mlen < 15 ? mlen : 15;
+        if (mlen >= 15) {
+            size_t x = mlen - 15;
+            for (; x >= 255; x -= 255)
+                *p++ = 255;
+            *p++ = x;
+        }
+    }
+    *op = p;
+    return 1;
+}
+
+// lz_compress(src, n, dst, cap)
+//    compress the `n` bytes at `src` (at most LZ_BLOCK) into `dst`, which
+//    holds `cap` bytes. Returns the compressed size, or 0 if it didn't fit.
+//    The format is LZ4's block format: each sequence is a token byte (the
+//    literal count in the high nibble, the match length minus 4 in the
+//    low, where 15 means bytes adding up to 255 each follow), the
+//    literals, a 2-byte match offset, and the rest of the match length.
+//    Matches come from a hash table of 4-byte strings; the search speeds
+//    up through data that doesn't match.
+static size_t lz_compress(const unsigned char* src, size_t n,
+                          unsigned char* dst, size_t cap) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* end = src + n;
+    unsigned char* op = dst;
+    unsigned misses = 0;
+    while (end - ip >= LZ_MIN_MATCH) {
+        uint32_t x, y;
+        memcpy(&x, ip, 4);
+        unsigned h = (x * 2654435761U) >> (32 - LZ_HASH_BITS);
+        const unsigned char* ref = src + table[h];
+        table[h] = ip - src;
+        if (ref >= ip || (memcpy(&y, ref, 4), x != y)) {
+            size_t step = 1 + (misses++ >> 5);
+            if ((size_t) (end - ip) < step + LZ_MIN_MATCH)
+                break;
+            ip += step;
+            continue;
+        }
+        misses = 0;
+        // extend the match 8 bytes at a time
+        const unsigned char* mp = ip + LZ_MIN_MATCH;
+        const unsigned char* rp = ref + LZ_MIN_MATCH;
+        while (end - mp >= 8) {
+            uint64_t a, b;
+            memcpy(&a, mp, 8);
+            memcpy(&b, rp, 8);
+            if (a != b) {
+                mp += __builtin_ctzll(a ^ b) >> 3;
+                goto matched;
+            }
+            mp += 8;
+            rp += 8;
+        }
+        while (mp != end && *mp == *rp) {
+            ++mp;
+            ++rp;
+        }
+    matched:
+        if (!lz_sequence(&op, dst + cap, anchor, ip - anchor, ip - ref,
+                         mp - ip - LZ_MIN_MATCH))
+            return 0;
+        ip = anchor = mp;
+    }
+    if (!lz_sequence(&op, dst + cap, anchor, end - anchor, 0, 0))
+        return 0;
+    return op - dst;
+}
+
+// lz_decompress(src, n, dst, cap)
+//    decompress the `n` bytes at `src` into `dst`, which holds `cap`
+//    bytes. Returns the decompressed size, or -1 if the data is corrupt.
+static ssize_t lz_decompress(const unsigned char* src, size_t n,
+                             unsigned char* dst, size_t cap) {
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + n;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+    while (ip != iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        unsigned x = 255;
+        if (nlit == 15)
+            while (x == 255 && ip != iend)
+                nlit += x = *ip++;
+        if ((size_t) (iend - ip) < nlit || (size_t) (oend - op) < nlit)
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend)
+            break;              // the last sequence has no match
+        if (iend - ip < 2)
+            return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        x = 255;
+        if (mlen == 15)
+            while (x == 255 && ip != iend)
+                mlen += x = *ip++;
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t) (op - dst)
+            || (size_t) (oend - op) < mlen)
+            return -1;
+        const unsigned char* m = op - off;
+        if (off >= mlen)
+            memcpy(op, m, mlen);
+        else
+            for (size_t i = 0; i != mlen; ++i)
+                op[i] = m[i];   // overlapping: repeats the last `off` bytes
+        op += mlen;
+    }
+    return op - dst;
+}
+
+// lz_read_all(raw, buf, sz)
+//    read exactly `sz` bytes from `raw`, or fewer at end of file
+static ssize_t lz_read_all(io61_file* raw, unsigned char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        ssize_t r = io61_read(raw, (char*) buf + nread, sz - nread);
+        if (r <= 0)
+            return nread ? (ssize_t) nread : r;
+        nread += r;
+    }
+    return nread;
+}
+
+// lz_index(f)
+//    load the trailer and block index of the compressed file under reader
+//    `f`, if it has them
+static void lz_index(io61_file* f) {
+    io61_lz* z = f->lz;
+    off_t size = io61_filesize(z->raw);
+    unsigned char t[LZ_TRAILER];
+    if (size < (off_t) (LZ_HEADER + z->bh + LZ_TRAILER)
+        || io61_pread(z->raw, (char*) t, LZ_TRAILER, size - LZ_TRAILER)
+           != LZ_TRAILER
+        || memcmp(t + 16, lz_trailer_magic, 8) != 0)
+        return;
+    off_t data_size = lz_get(t, 8);
+    off_t index_pos = lz_get(t + 8, 8);
+    off_t nblocks = (size - LZ_TRAILER - index_pos) / 8;
+    if (index_pos < (off_t) (LZ_HEADER + z->bh)
+        || index_pos + nblocks * 8 + LZ_TRAILER != size
+        || data_size < 0 || (data_size + LZ_BLOCK - 1) / LZ_BLOCK != nblocks)
+        return;
+    unsigned char* p = (unsigned char*) malloc(nblocks * 8 + 1);
+    uint64_t* index = (uint64_t*) malloc((nblocks + 1) * sizeof(uint64_t));
+    if (p && index && io61_pread(z->raw, (char*) p, nblocks * 8, index_pos)
+                      == nblocks * 8) {
+        for (off_t k = 0; k != nblocks; ++k)
+            index[k] = lz_get(p + 8 * k, 8);
+        index[nblocks] = index_pos - z->bh;
+        z->index = index;
+        z->nblocks = nblocks;
+        z->size = data_size;
+        index = NULL;
+    }
+    free(p);
+    free(index);
+}
+
+// lz_load(f, k)
+//    decode block `k` of compressed reader `f`; a reader without an index
+//    decodes its next block instead. Returns the block's size, 0 at the
+//    end, or -1 on error, including a checksum that doesn't match.
+static ssize_t lz_load(io61_file* f, off_t k) {
+    io61_lz* z = f->lz;
+    const unsigned char* p = z->packed;
+    size_t dsz, psz;
+    uint32_t crc = 0;
+    if (z->index) {
+        if (k >= z->nblocks)
+            return 0;
+        size_t n = z->index[k + 1] - z->index[k];
+        if (z->index[k + 1] <= z->index[k] || n > LZ_BLOCK + z->bh
+            || io61_pread(z->raw, (char*) z->packed, n, z->index[k])
+               != (ssize_t) n
+            || lz_get(p + 4, 4) != n - z->bh)
+            goto corrupt;
+        dsz = lz_get(p, 4);
+        psz = n - z->bh;
+        crc = z->crc ? lz_get(p + 8, 4) : 0;
+    } else {
+        if (z->done)
+            return 0;
+        // EOF before the end marker means the stream was cut short
+        ssize_t r = lz_read_all(z->raw, z->packed, z->bh);
+        if (r != (ssize_t) z->bh)
+            goto corrupt;
+        dsz = lz_get(p, 4);
+        psz = lz_get(p + 4, 4);
+        crc = z->crc ? lz_get(p + 8, 4) : 0;
+        if (dsz == 0) {
+            if (z->crc && (psz != (size_t) z->blk + 1 || crc != ~z->sum))
+                goto corrupt;
+            // the end marker: skip the index, so a writer on the other
+            // end of a pipe can finish
+            z->done = 1;
+            while (io61_read(z->raw, (char*) z->packed, LZ_BLOCK) > 0) {
+            }
+            return 0;
+        }
+        if (psz > LZ_BLOCK
+            || lz_read_all(z->raw, z->packed, psz) != (ssize_t) psz)
+            goto corrupt;
+        k = z->blk + 1;
+    }
+    if (dsz == 0 || dsz > LZ_BLOCK || psz > dsz)
+        goto corrupt;
+    if (z->index)
+        p += z->bh;
+    unsigned long long t = lz_usec();
+    if (psz == dsz)
+        memcpy(z->buf, p, dsz);
+    else if (lz_decompress(p, psz, z->buf, LZ_BLOCK) != (ssize_t) dsz)
+        goto corrupt;
+    if (z->crc) {
+        if (crc32c(z->buf, dsz) != crc)
+            goto corrupt;
+        unsigned char c[4];
+        lz_put(c, crc, 4);
+        z->sum = crc32c_update(z->sum, c, 4);
+    }
+    f->st->n[ST_LZ_USEC] += lz_usec() - t;
+    f->st->n[ST_LZ_RAW] += dsz;
+    f->st->n[ST_LZ_PACKED] += psz + z->bh;
+    z->blk = k;
+    z->len = dsz;
+    return dsz;
+
+ corrupt:
+    z->blk = -1;
+    errno = EINVAL;
+    return -1;
+}
+
+// lz_span(f, p)
+//    read_span() for compressed reader `f`: set `*p` to the decoded data
+//    at its position and return how much there is
+static ssize_t lz_span(io61_file* f, const char** p) {
+    io61_lz* z = f->lz;
+    off_t k = f->pos / LZ_BLOCK;
+    size_t ofs = f->pos % LZ_BLOCK;
+    if (z->blk != k || ofs >= z->len) {
+        ssize_t r = z->index && f->pos >= z->size ? 0 : lz_load(f, k);
+        if (r <= 0) {
+            f->eof = (r == 0);
+            return r;
+        }
+        if (z->blk != k || ofs >= z->len) {
+            // only the last block can be short
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    *p = (const char*) z->buf + ofs;
+    return z->len - ofs;
+}
+
+// lz_read(f, buf, sz)
+//    io61_read() for compressed reader `f`
+static ssize_t lz_read(io61_file* f, char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        const char* p;
+        ssize_t r = lz_span(f, &p);
+        if (r <= 0) {
+            if (r == -1 && nread == 0)
+                return -1;
+            break;
+        }
+        size_t n = sz - nread < (size_t) r ? sz - nread : (size_t) r;
+        memcpy(buf + nread, p, n);
+        f->pos += n;
+        nread += n;
+    }
+    return nread;
+}
+
+// lz_pread(f, buf, sz, off)
+//    io61_pread() for compressed reader `f`, which needs an index. Each
+//    call decodes into its own buffer, so threads don't interfere.
+static ssize_t lz_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    io61_lz* z = f->lz;
+    if (!z->index) {
+        errno = ESPIPE;
+        return -1;
+    }
+    if (off >= z->size)
+        return 0;
+    if (sz > (size_t) (z->size - off))
+        sz = z->size - off;
+    unsigned char* packed = (unsigned char*) malloc(2 * LZ_BLOCK + z->bh);
+    unsigned char* data = packed + LZ_BLOCK + z->bh;
+    size_t nread = 0;
+    while (nread != sz) {
+        off_t k = (off + nread) / LZ_BLOCK;
+        size_t ofs = (off + nread) % LZ_BLOCK;
+        size_t n = z->index[k + 1] - z->index[k];
+        ssize_t dsz = -1;
+        if (n >= z->bh && n <= LZ_BLOCK + z->bh
+            && io61_pread(z->raw, (char*) packed, n, z->index[k])
+               == (ssize_t) n) {
+            dsz = lz_get(packed, 4);
+            if (dsz > LZ_BLOCK || n - z->bh > (size_t) dsz)
+                dsz = -1;
+            else if (n - z->bh == (size_t) dsz)
+                memcpy(data, packed + z->bh, dsz);
+            else if (lz_decompress(packed + z->bh, n - z->bh, data, LZ_BLOCK)
+                     != dsz)
+                dsz = -1;
+            if (dsz > 0 && z->crc
+                && crc32c(data, dsz) != lz_get(packed + 8, 4))
+                dsz = -1;
+        }
+        if (dsz <= (ssize_t) ofs) {
+            errno = EINVAL;
+            break;
+        }
+        count_shared(f, ST_LZ_RAW, dsz);
+        count_shared(f, ST_LZ_PACKED, n);
+        size_t m = dsz - ofs < sz - nread ? dsz - ofs : sz - nread;
+        memcpy(buf + nread, data + ofs, m);
+        nread += m;
+    }
+    free(packed);
+    return nread || sz == 0 ? (ssize_t) nread : -1;
+}
+
+// lz_thread(arg)
+//    compression thread: compress slots as the writer hands them over,
+//    until told to stop. It touches only the slots and their `out`
+//    buffers; the writer does all the I/O (see lz_drain()).
+static void* lz_thread(void* arg) {
+    io61_file* f = (io61_file*) arg;
+    io61_lz* z = f->lz;
+    while (1) {
+        pthread_mutex_lock(&z->lock);
+        while (z->tail == z->head)
+            pthread_cond_wait(&z->filled, &z->lock);
+        unsigned s = z->tail % LZ_SLOTS;
+        pthread_mutex_unlock(&z->lock);
+        size_t len = z->slot_len[s];
+        if (len == 0)
+            break;
+        unsigned char* out = z->out[s];
+        unsigned long long t = lz_usec();
+        // a block that doesn't shrink is stored as is
+        size_t psz = 0;
+        if (z->compress)
+            psz = lz_compress(z->slot[s], len, out + z->bh, len - 1);
+        lz_put(out, len, 4);
+        lz_put(out + 4, psz ? psz : len, 4);
+        if (z->crc)
+            lz_put(out + 8, crc32c(z->slot[s], len), 4);
+        count_shared(f, ST_LZ_USEC, lz_usec() - t);
+        pthread_mutex_lock(&z->lock);
+        ++z->tail;
+        pthread_cond_signal(&z->drained);
+        pthread_mutex_unlock(&z->lock);
+    }
+    return NULL;
+}
+
+// lz_emit(f, s)
+//    write out slot `s` of compressed writer `f`, which the thread has
+//    compressed, and add it to the index
+static void lz_emit(io61_file* f, unsigned s) {
+    io61_lz* z = f->lz;
+    const unsigned char* out = z->out[s];
+    size_t len = z->slot_len[s];
+    size_t psz = lz_get(out + 4, 4);
+    if (z->crc)
+        z->sum = crc32c_update(z->sum, out + 8, 4);
+    if (z->nblocks == (off_t) z->index_cap) {
+        z->index_cap = z->index_cap ? 2 * z->index_cap : 256;
+        z->index = (uint64_t*) realloc(z->index,
+                                       z->index_cap * sizeof(uint64_t));
+        assert(z->index);
+    }
+    z->index[z->nblocks++] = z->raw_pos;
+    z->raw_pos += z->bh + psz;
+    f->st->n[ST_LZ_RAW] += len;
+    f->st->n[ST_LZ_PACKED] += z->bh + psz;
+    if (psz != len ? io61_write(z->raw, (const char*) out, z->bh + psz) == -1
+        : io61_write(z->raw, (const char*) out, z->bh) == -1
+          || io61_write(z->raw, (const char*) z->slot[s], len) == -1)
+        z->error = 1;
+}
+
+// lz_drain(f, keep)
+//    write out, in order, the slots compressed writer `f`'s thread has
+//    finished, waiting for it until at most `keep` slots are unwritten
+static void lz_drain(io61_file* f, unsigned keep) {
+    io61_lz* z = f->lz;
+    while (z->written != z->head) {
+        pthread_mutex_lock(&z->lock);
+        while (z->tail == z->written && z->head - z->written > keep)
+            pthread_cond_wait(&z->drained, &z->lock);
+        unsigned tail = z->tail;
+        pthread_mutex_unlock(&z->lock);
+        if (tail == z->written)
+            break;
+        for (; z->written != tail; ++z->written)
+            lz_emit(f, z->written % LZ_SLOTS);
+    }
+}
+
+// lz_hand(f)
+//    hand compressed writer `f`'s current slot to the thread
+static void lz_hand(io61_file* f) {
+    io61_lz* z = f->lz;
+    pthread_mutex_lock(&z->lock);
+    ++z->head;
+    pthread_cond_signal(&z->filled);
+    pthread_mutex_unlock(&z->lock);
+    z->held = 0;
+}
+
+// lz_slot(f)
+//    return compressed writer `f`'s slot to fill, handing a full one to
+//    the thread first
+static unsigned lz_slot(io61_file* f) {
+    io61_lz* z = f->lz;
+    if (z->held && z->slot_len[z->head % LZ_SLOTS] == LZ_BLOCK)
+        lz_hand(f);
+    if (!z->held) {
+        // write out what's finished, waiting if every slot is in use
+        lz_drain(f, LZ_SLOTS - 1);
+        z->held = 1;
+        z->slot_len[z->head % LZ_SLOTS] = 0;
+    }
+    return z->head % LZ_SLOTS;
+}
+
+// lz_write(f, buf, sz)
+//    io61_write() for compressed writer `f`
+static ssize_t lz_write(io61_file* f, const char* buf, size_t sz) {
+    io61_lz* z = f->lz;
+    if (z->error)
+        return -1;
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        unsigned s = lz_slot(f);
+        size_t n = LZ_BLOCK - z->slot_len[s];
+        if (n > sz - nwritten)
+            n = sz - nwritten;
+        memcpy(z->slot[s] + z->slot_len[s], buf + nwritten, n);
+        z->slot_len[s] += n;
+        f->pos += n;
+        nwritten += n;
+    }
+    // start on a full block now
+    if (z->slot_len[z->head % LZ_SLOTS] == LZ_BLOCK)
+        lz_slot(f);
+    return sz;
+}
+
+// lz_flush(f)
+//    io61_flush() for compressed writer `f`: wait for the thread and write
+//    out every full block
+static int lz_flush(io61_file* f) {
+    io61_lz* z = f->lz;
+    if (f->mode != O_WRONLY)
+        return 0;
+    if (z->held && z->slot_len[z->head % LZ_SLOTS] == LZ_BLOCK)
+        lz_slot(f);
+    lz_drain(f, 0);
+    if (io61_flush(z->raw) == -1)
+        z->error = 1;
+    return z->error ? -1 : 0;
+}
+
+// lz_open(raw, name, mode)
+//    return a compressed file over `raw`, the io61_file for the compressed
+//    bytes, or NULL if `raw` is a reader that doesn't start with a header.
+//    A writer compresses blocks if `mode` has IO61_COMPRESS and checksums
+//    them if it has IO61_CHECKSUM; a reader follows the header's flags.
+static io61_file* lz_open(io61_file* raw, const char* name, int mode) {
+    io61_lz* z = (io61_lz*) calloc(1, sizeof(io61_lz));
+    z->raw = raw;
+    z->blk = -1;
+    z->size = -1;
+    z->sum = ~0U;
+    crc32c_init();
+    unsigned char h[LZ_HEADER];
+    if (raw->mode == O_RDONLY) {
+        if (lz_read_all(raw, h, LZ_HEADER) != LZ_HEADER
+            || memcmp(h, lz_magic, 8) != 0
+            || lz_get(h + 8, 4) != LZ_BLOCK
+            || (lz_get(h + 12, 4) & ~LZ_CRC) != 0) {
+            free(z);
+            return NULL;
+        }
+        z->crc = lz_get(h + 12, 4) & LZ_CRC;
+        z->bh = LZ_BLOCK_HEADER + (z->crc ? 4 : 0);
+        z->buf = (unsigned char*) malloc(LZ_BLOCK);
+        z->packed = (unsigned char*) malloc(z->bh + LZ_BLOCK);
+    } else {
+        z->compress = (mode & IO61_COMPRESS) != 0;
+        z->crc = (mode & IO61_CHECKSUM) != 0;
+        z->bh = LZ_BLOCK_HEADER + (z->crc ? 4 : 0);
+        memcpy(h, lz_magic, 8);
+        lz_put(h + 8, LZ_BLOCK, 4);
+        lz_put(h + 12, z->crc ? LZ_CRC : 0, 4);
+        if (io61_write(raw, (const char*) h, LZ_HEADER) == -1)
+            z->error = 1;
+        z->raw_pos = LZ_HEADER;
+        for (int i = 0; i != LZ_SLOTS; ++i) {
+            z->slot[i] = (unsigned char*) malloc(LZ_BLOCK);
+            z->out[i] = (unsigned char*) malloc(z->bh + LZ_BLOCK);
+        }
+    }
+
+    // the file a compressed file's user sees only needs the fields that
+    // its cursor and the position use
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
+    f->fd = raw->fd;
+    f->mode = raw->mode;
+    stats_open(f);
+    char sname[sizeof(f->st->name)];
+    snprintf(sname, sizeof(sname), "%.*s (uncompressed)",
+             (int) sizeof(sname) - 16, name);
+    stats_name(f, sname);
+    f->lz = z;
+    f->cur = f->head = f->tail = -1;
+    f->line_blk = f->c_blk = -1;
+    f->f_size = -1;
+    if (raw->mode == O_RDONLY && raw->seekable) {
+        lz_index(f);
+        f->seekable = z->index != NULL;
+        f->f_size = z->size;
+    }
+    if (raw->mode == O_WRONLY) {
+        pthread_mutex_init(&z->lock, NULL);
+        pthread_cond_init(&z->filled, NULL);
+        pthread_cond_init(&z->drained, NULL);
+        int r = pthread_create(&z->thread, NULL, lz_thread, f);
+        assert(r == 0);
+    }
+    return f;
+}
+
+// lz_close(f)
+//    io61_close() for compressed file `f`: a writer writes its last
+//    block, the end marker, the index and the trailer
+static int lz_close(io61_file* f) {
+    io61_lz* z = f->lz;
+    cursor_close(f);
+    line_unpin(f);
+    free(f->lbuf);
+    int r = 0;
+    if (f->mode == O_WRONLY) {
+        if (z->held && z->slot_len[z->head % LZ_SLOTS] > 0)
+            lz_hand(f);
+        lz_drain(f, 0);
+        lz_slot(f);             // an empty slot stops the thread
+        lz_hand(f);
+        pthread_join(z->thread, NULL);
+        pthread_mutex_destroy(&z->lock);
+        pthread_cond_destroy(&z->filled);
+        pthread_cond_destroy(&z->drained);
+        size_t tsz = z->bh + z->nblocks * 8 + LZ_TRAILER;
+        unsigned char* t = (unsigned char*) malloc(tsz);
+        lz_put(t, 0, 4);
+        lz_put(t + 4, z->nblocks, 4);
+        if (z->crc)
+            lz_put(t + 8, ~z->sum, 4);
+        for (off_t k = 0; k != z->nblocks; ++k)
+            lz_put(t + z->bh + 8 * k, z->index[k], 8);
+        unsigned char* tr = t + z->bh + z->nblocks * 8;
+        lz_put(tr, f->pos, 8);
+        lz_put(tr + 8, z->raw_pos + z->bh, 8);
+        memcpy(tr + 16, lz_trailer_magic, 8);
+        if (z->error || io61_write(z->raw, (const char*) t, tsz) == -1)
+            r = -1;
+        free(t);
+        for (int i = 0; i != LZ_SLOTS; ++i) {
+            free(z->slot[i]);
+            free(z->out[i]);
+        }
+    }
+    if (io61_close(z->raw) == -1)
+        r = -1;
+    free(z->buf);
+    free(z->packed);
+    free(z->index);
+    free(z);
+    free(f);
+    return r;
+}
+
+// cursors
+//    io61_readc() and io61_writec() move `f->c` through a buffer by
+//    themselves (see io61.h). While the cursor is open, `f->pos` and the
+//    buffer's bookkeeping stay where they were when the cursor was at
+//    `c_start`; cursor_sync() brings them up to date. Anything that uses
+//    `f`'s position or buffers other than through the cursor syncs or
+//    closes it first. A cursor in a cached block pins the block, so the
+//    cache won't hand it to another file.
+
+// cursor_sync(f)
+//    account for the characters `f`'s cursor has moved over
+static void cursor_sync(io61_file* f) {
+    if (f->c.r) {
+        ptrdiff_t n = f->c.r - f->c_start;
+        f->pos += n;
+        if (f->sbuf)
+            f->s_off += n;
+        f->c_start = f->c.r;
+    } else if (f->c.w && f->c.w != f->c_start) {
+        size_t n = f->c.w - f->c_start;
+        if (f->lz)
+            f->lz->slot_len[f->lz->head % LZ_SLOTS] += n;
+        else if (f->dbuf)
+            f->d_hi += n;
+        else if (f->sbuf)
+            f->s_len += n;
+        else {
+            // extends the dirty range the cursor started at, so this
+            // needs no new range
+            io61_block* b = &cache.blocks[f->c_blk];
+            int ofs = f->c_start - b->buf;
+            dirty_add(b, ofs, ofs + n);
+            // a read/write file's block and file may have grown
+            if (f->mode == O_RDWR && ofs + (ssize_t) n > b->sz) {
+                b->sz = ofs + n;
+                if (b->pos + b->sz > f->f_size)
+                    f->f_size = b->pos + b->sz;
+            }
+        }
+        f->pos += n;
+        f->c_start = f->c.w;
+    }
+}
+
+// cursor_close(f)
+//    sync `f`'s cursor and close it
+static void cursor_close(io61_file* f) {
+    if (!f->c.r && !f->c.w)
+        return;
+    cursor_sync(f);
+    f->c.r = f->c.r_end = f->c.w = f->c.w_end = NULL;
+    if (f->c_blk >= 0) {
+        --cache.blocks[f->c_blk].pin;
+        f->c_blk = -1;
+    }
+}
+
+// cursor_read(f)
+//    open a read cursor at `f`'s position if the data there is already
+//    in memory
+static void cursor_read(io61_file* f) {
+    unsigned char* lo;
+    unsigned char* p;
+    unsigned char* end;
+    if (f->mode == O_WRONLY)
+        return;
+    if (f->lz) {
+        io61_lz* z = f->lz;
+        if (z->blk < 0 || f->pos < z->blk * LZ_BLOCK
+            || f->pos >= z->blk * LZ_BLOCK + (off_t) z->len)
+            return;
+        lo = z->buf;
+        p = lo + (f->pos - z->blk * LZ_BLOCK);
+        end = lo + z->len;
+    } else if (f->map && (uint64_t) (f->pos - f->map_pos) < f->map_sz) {
+        lo = f->map;
+        p = lo + (f->pos - f->map_pos);
+        end = lo + f->map_sz;
+    } else if (f->dbuf) {
+        if (f->pos < f->d_pos || f->pos >= f->d_pos + (off_t) f->d_hi)
+            return;
+        lo = (unsigned char*) f->dbuf;
+        p = lo + (f->pos - f->d_pos);
+        end = lo + f->d_hi;
+    } else if (f->sbuf) {
+        if (f->s_off == f->s_len)
+            return;
+        lo = p = (unsigned char*) f->sbuf + f->s_off;
+        end = (unsigned char*) f->sbuf + f->s_len;
+    } else {
+        if (f->cur < 0)
+            return;
+        io61_block* b = &cache.blocks[f->cur];
+        int ofs = find_block_ofs(f->pos);
+        if (b->f != f || b->block != find_block(f->pos) || ofs >= b->sz
+            || b->pin)
+            return;
+        ++b->pin;
+        f->c_blk = f->cur;
+        lo = b->buf;
+        p = lo + ofs;
+        end = lo + b->sz;
+    }
+    f->c.r = f->c_start = p;
+    f->c.r_end = end;
+    f->c_lo = lo;
 }
 
-static inline off_t find_block_pos(off_t off) {
-    return off & (off_t)~0x0FFF;
-    //return find_block(off) * BLOCK_SIZE; 
+// cursor_write(f)
+//    open a write cursor at `f`'s position if its buffer there can take
+//    more characters without any bookkeeping but the cursor's
+static void cursor_write(io61_file* f) {
+    unsigned char* p;
+    unsigned char* end;
+    if (f->mode == O_RDONLY)
+        return;
+    if (f->lz) {
+        unsigned s = lz_slot(f);
+        p = f->lz->slot[s] + f->lz->slot_len[s];
+        end = f->lz->slot[s] + LZ_BLOCK;
+    } else if (f->dbuf) {
+        if (f->d_lo == f->d_hi || f->pos != f->d_pos + (off_t) f->d_hi
+            || f->d_hi == DIRECT_BUF)
+            return;
+        p = (unsigned char*) f->dbuf + f->d_hi;
+        end = (unsigned char*) f->dbuf + DIRECT_BUF;
+    } else if (f->sbuf) {
+        if (f->s_len == f->s_cap)
+            return;
+        p = (unsigned char*) f->sbuf + f->s_len;
+        end = (unsigned char*) f->sbuf + f->s_cap;
+    } else {
+        // the cursor must continue the block's last dirty range, and
+        // stops short of the block's last byte, which goes through
+        // buffer_write() to start write-back
+        if (f->cur < 0)
+            return;
+        io61_block* b = &cache.blocks[f->cur];
+        int ofs = find_block_ofs(f->pos);
+        if (b->f != f || b->block != find_block(f->pos) || b->ndirty == 0
+            || b->dirty_hi[b->ndirty - 1] != ofs || ofs >= BLOCK_SIZE - 1
+            || b->pin)
+            return;
+        ++b->pin;
+        f->c_blk = f->cur;
+        p = b->buf + ofs;
+        end = b->buf + BLOCK_SIZE - 1;
+    }
+    f->c.w = f->c_start = p;
+    f->c.w_end = end;
 }
 
-static inline int find_block_ofs(off_t off) { 
-    return off & (off_t)0x0FFF;
-    //return off % BLOCK_SIZE; 
+// read_span(f, p)
+//    set `*p` to the data at `f`'s position that is already in memory, in
+//    its mapping or a buffer, reading more if there is none. Returns the
+//    number of bytes there (which stay unread), 0 at end of file, or -1 on
+//    error. Also returns the cache block holding them in `*blk`, or -1.
+static ssize_t read_span(io61_file* f, const char** p, int* blk) {
+    *blk = -1;
+    if (f->lz)
+        return lz_span(f, p);
+    if (f->map) {
+        if (f->pos >= f->f_size) {
+            f->eof = 1;
+            return 0;
+        }
+        if (map_covers(f, f->pos)) {
+            *p = (const char*) f->map + (f->pos - f->map_pos);
+            return f->map_pos + f->map_sz - f->pos;
+        }
+    }
+    if (f->dbuf) {
+        if (f->pos < f->d_pos || f->pos >= f->d_pos + (off_t) f->d_hi) {
+            // a one-byte read refills `dbuf` around the position
+            char c;
+            ssize_t r = direct_read(f, &c, 1);
+            if (r <= 0)
+                return r;
+            --f->pos;
+        }
+        *p = f->dbuf + (f->pos - f->d_pos);
+        return f->d_pos + f->d_hi - f->pos;
+    }
+    if (f->sbuf) {
+        if (f->s_off == f->s_len) {
+            ssize_t r = stream_fill(f, NULL, 0);
+            if (r <= 0)
+                return r;
+        }
+        *p = f->sbuf + f->s_off;
+        return f->s_len - f->s_off;
+    }
+    off_t block = find_block(f->pos);
+    int ofs = find_block_ofs(f->pos);
+    io61_block* b;
+    if (f->cur >= 0 && cache.blocks[f->cur].f == f
+        && cache.blocks[f->cur].block == block)
+        b = &cache.blocks[f->cur];
+    else
+        b = find_block_data(f, block, 0);
+    ssize_t r = 0;
+    if (ofs >= b->sz
+        && (b->sz == BLOCK_SIZE || (r = read_block(f, b)) <= 0
+            || ofs >= b->sz))
+        return r < 0 ? -1 : 0;
+    *p = (const char*) b->buf + ofs;
+    *blk = b - cache.blocks;
+    return b->sz - ofs;
 }
 
-// defines slot size, assignment
-#define NSLOTS 0x100
-//#define NSLOTS 64
-static inline int find_slot(off_t off) { 
-    return find_block(off) & 0x0FF; 
-    //return find_block(off) % NSLOTS;
+// io61_readc_slow(f)
+//    Read a single (unsigned) character from `f` and return it, when
+//    io61_readc() finds its cursor empty. Returns EOF (which is -1) on
+//    error or end-of-file. Opens a new cursor after the character.
+
+int io61_readc_slow(io61_file* f) {
+    cursor_close(f);
+    const char* p;
+    int blk;
+    if (read_span(f, &p, &blk) <= 0)
+        return EOF;
+    ++f->pos;
+    if (f->sbuf)
+        ++f->s_off;
+    cursor_read(f);
+    return (unsigned char) *p;
 }
 
 
-typedef struct io61_slot {
-    unsigned char buf[BLOCK_SIZE];
-    off_t block; // block number
-    off_t pos;   // block pos
-    ssize_t sz;  // size of cached data
-} io61_slot;
+// io61_read(f, buf, sz)
+//    Read up to `sz` characters from `f` into `buf`. Returns the number of
+//    characters read on success; normally this is `sz`. Returns a short
+//    count, which might be zero, if the file ended before `sz` characters
+//    could be read. Returns -1 if an error occurred before any characters
+//    were read.
+//    Cached data is copied a block span at a time; an uncached request of
+//    at least a block goes straight from the kernel into `buf`, except in a
+//    read/write file, whose later blocks may be dirty.
 
-typedef struct io61_file {
-    int fd;
-    int mode;
-    off_t pos; // logical file pos, maybe cached
-    io61_slot slots [NSLOTS];
-    //int allowseek; // is file seekable
-    off_t f_pos; // actual file pos, 
-    off_t f_size; // only used in read mode
-    int seq_mode;  // sequential mode: 
-                   //       -1:unknown, initially default to -1 (if not allowseek, default to 0)
-                   //        0: sequential read, after 10 sequential readc, change to 0
-                   //        1: not sequential: any io61_seek(), change to not sequencial
-    
-} io61_file;
+ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
+    // a request that fits in the cursor is copied from there
+    if (!f->c.r && !f->c.w)
+        cursor_read(f);
+    if (f->c.r_end - f->c.r >= (ptrdiff_t) sz) {
+        memcpy(buf, f->c.r, sz);
+        f->c.r += sz;
+        return sz;
+    }
+    cursor_close(f);
+    if (f->lz)
+        return lz_read(f, buf, sz);
+    if (f->sbuf)
+        return stream_read(f, buf, sz);
+    if (f->dbuf)
+        return direct_read(f, buf, sz);
+    size_t nread = 0;
+    ssize_t r = 0;
+    if (f->map)
+        detect_miss(f);
+    while (nread != sz) {
+        if (f->map) {
+            if (f->pos >= f->f_size) {
+                f->eof = 1;
+                break;
+            }
+            if (map_covers(f, f->pos)) {
+                size_t n = f->map_pos + f->map_sz - f->pos;
+                if (n > sz - nread)
+                    n = sz - nread;
+                memcpy(buf + nread, f->map + (f->pos - f->map_pos), n);
+                f->pos += n;
+                nread += n;
+                continue;
+            }
+        }
 
+        off_t block = find_block(f->pos);
+        int ofs = find_block_ofs(f->pos);
+        int i = cache_lookup(f, block);
 
-// read_slot()
-//     read one block data into cached slot 
-int read_slot(io61_file* f, int slot_num, off_t block_num) {
-    assert(f->mode == O_RDONLY); 
-    
-    // replace slot with new_block data
-    off_t new_block_pos = block_num * BLOCK_SIZE;
-    io61_slot* s = &f->slots[slot_num];
-    
-    switch (f->seq_mode) {
-        case -1:
-        case 0: // no seek needed, verify position is correct
-            //if (new_block_pos != f->f_pos) printf ("%ld %ld \n", new_block_pos, f->f_pos); 
-            assert(new_block_pos == f->f_pos);
-            break;
-        case 1: // io61_seek() requested at least once
-            if (f->f_size != -1 && f->pos >= f->f_size)  // file ended
-                return EOF;
-            if (new_block_pos != f->f_pos) {
-                int new_pos = lseek(f->fd, new_block_pos, SEEK_SET);
-                assert(new_pos != -1); 
-                f->f_pos = new_block_pos;
+        if (i < 0 && sz - nread >= BLOCK_SIZE && f->mode == O_RDONLY) {
+            ++f->st->n[ST_MISSES];
+            struct iovec iov = { buf + nread, sz - nread };
+            size_t zeroed = f->sparse ? hole_fill(f, f->pos, &iov, 1) : 0;
+            if (zeroed > 0) {
+                f->pos += zeroed;
+                nread += zeroed;
+                continue;
             }
+            do {
+                if (f->seekable) {
+                    r = pread(f->fd, iov.iov_base, iov.iov_len, f->pos);
+                    count_io(f, ST_READS, r);
+                } else
+                    r = stream_readv(f, &iov, 1);
+            } while (r == -1 && errno == EINTR);
+            if (r <= 0) {
+                f->eof = (r == 0);
+                break;
+            }
+            if (!f->seekable)
+                f->f_pos += r;
+            f->pos += r;
+            nread += r;
+            continue;
+        }
+
+        io61_block* b;
+        if (i >= 0) {
+            b = &cache.blocks[i];
+            if (i != f->cur)
+                cache_touch(f, i);
+            uring_wait(b);
+            cache_hit(f, b);
+        } else
+            b = find_block_data(f, block, 0);
+        if (ofs >= b->sz
+            && (b->sz == BLOCK_SIZE || (r = read_block(f, b)) <= 0
+                || ofs >= b->sz))
+            break;
+        size_t n = b->sz - ofs;
+        if (n > sz - nread)
+            n = sz - nread;
+        memcpy(buf + nread, b->buf + ofs, n);
+        f->pos += n;
+        nread += n;
     }
-    ssize_t r = read(f->fd, s->buf, BLOCK_SIZE);
-//char x = s->buf[5];  s->buf[5]= 0;printf("wrbuffer %d, %d, [%s] \n", s->pos, s->sz, s->buf);s->buf[5]= x;
-//printf ("read buffer(%ld %ld) \n", f->f_pos, r);
-//s->buf[r] = 0; printf ("read buffer(%ld %ld) [%s]\n", f->f_pos, r, s->buf);
-    if (r == -1 || r == 0)
-        return EOF;
-    f->f_pos += r; // keep track of real file position
-    s->block = block_num;
-    s->pos = new_block_pos;
-    s->sz = r;
-    return r;
+    if (nread == 0 && r == -1 && sz != 0)
+        return -1;
+    return nread;
 }
 
-// flush_slot()
-//    flush one cached slot to disk/device
-int flush_slot(io61_file* f, int slot_num) {
-    assert(f->mode == O_WRONLY); 
-        
-    io61_slot *s = &f->slots[slot_num];
-    if (s->sz > 0 && s->pos >= 0) {
-        if (f->seq_mode != 1) {
-            //if (s->pos != f->f_pos) printf("%ld %ld\n", s->pos, f->f_pos);
-            assert(s->pos == f->f_pos);
-        } else {
-            if (f->f_pos != s->pos) { 
-                int new_pos = lseek(f->fd, s->pos, SEEK_SET);
-                assert(new_pos != -1);
-                f->f_pos = new_pos;
+
+// line_unpin(f)
+//    let the cache replace the block io61_readline() last returned, and
+//    stream_absorb() move the stream buffer again
+static void line_unpin(io61_file* f) {
+    f->s_pin = 0;
+    if (f->line_blk >= 0) {
+        --cache.blocks[f->line_blk].pin;
+        f->line_blk = -1;
+    }
+}
+
+
+// io61_readline(f, linep, lenp)
+//    Read a line from `f`, up to and including its newline, and set
+//    `*linep` to point at it and `*lenp` to its length. The last line of
+//    the file may lack a newline. Returns 1 if a line was read, 0 at end of
+//    file, or -1 if an error occurred before any characters were read.
+//    The line is not copied unless it spans two buffers. It stays valid
+//    until `f` is next read from or closed; other files may be used
+//    meanwhile.
+
+int io61_readline(io61_file* f, const char** linep, size_t* lenp) {
+    cursor_close(f);
+    line_unpin(f);
+    size_t len = 0;     // bytes saved in `f->lbuf`
+    while (1) {
+        const char* p;
+        int blk;
+        ssize_t n = read_span(f, &p, &blk);
+        if (n <= 0) {
+            if (len == 0)
+                return n;
+            break;
+        }
+        const char* nl = (const char*) memchr(p, '\n', n);
+        size_t take = nl ? (size_t) (nl + 1 - p) : (size_t) n;
+        f->pos += take;
+        if (f->sbuf)
+            f->s_off += take;
+        if (nl && len == 0) {
+            // the whole line is in place; keep it there
+            if (blk >= 0) {
+                ++cache.blocks[blk].pin;
+                f->line_blk = blk;
+            } else if (f->sbuf)
+                f->s_pin = 1;
+            *linep = p;
+            *lenp = take;
+            return 1;
+        }
+        if (len + take > f->lbuf_sz) {
+            size_t sz = f->lbuf_sz ? f->lbuf_sz : 256;
+            while (sz < len + take)
+                sz *= 2;
+            char* lbuf = (char*) realloc(f->lbuf, sz);
+            if (!lbuf) {
+                f->pos -= take;
+                if (f->sbuf)
+                    f->s_off -= take;
+                errno = ENOMEM;
+                if (len == 0)
+                    return -1;
+                break;
             }
+            f->lbuf = lbuf;
+            f->lbuf_sz = sz;
         }
-        ssize_t r = write(f->fd, s->buf, s->sz);
-//printf("wrbuffer %ld, %ld \n", s->pos, s->sz);
-        if (r <= 0)
+        memcpy(f->lbuf + len, p, take);
+        len += take;
+        if (nl)
+            break;
+    }
+    *linep = f->lbuf;
+    *lenp = len;
+    return 1;
+}
+
+
+// io61_writec_slow(f, ch)
+//    Write a single character `ch` to `f`, when io61_writec() finds its
+//    cursor full. Returns 0 on success or -1 on error. Opens a new cursor
+//    after the character.
+
+int io61_writec_slow(io61_file* f, int ch) {
+    cursor_close(f);
+    char c = ch;
+    if (f->lz) {
+        if (lz_write(f, &c, 1) != 1)
+            return -1;
+    } else if (f->dbuf) {
+        if (direct_write(f, &c, 1) != 1)
+            return -1;
+    } else if (f->sbuf) {
+        if (f->s_len == f->s_cap && stream_write(f, NULL, 0) == -1)
             return -1;
-        f->f_pos+=r;
-        s->block = s->pos = -1;
-        s->sz=0;
+        f->sbuf[f->s_len++] = ch;
+        ++f->pos;
+    } else {
+        io61_block* b = find_block_data(f, find_block(f->pos), 0);
+        if (buffer_write(f, b, find_block_ofs(f->pos), &c, 1) == -1)
+            return -1;
+        ++f->pos;
     }
+    cursor_write(f);
+    return 0;
 }
 
 
+// io61_write(f, buf, sz)
+//    Write `sz` characters from `buf` to `f`. Returns the number of
+//    characters written on success; normally this is `sz`. Returns -1 if
+//    an error occurred before any characters were written.
+//    Writes are copied into cached blocks, which go out in runs (see
+//    file_limit()); a write of at least RA_MAX blocks to a write-only file
+//    goes to the kernel directly, after any buffered data.
 
-// io61_fdopen(fd, mode)
-//    Return a new io61_file for file descriptor `fd`. `mode` is
-//    either O_RDONLY for a read-only file or O_WRONLY for a
-//    write-only file. You need not support read/write files.
+ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    // a request that fits in the cursor is copied there
+    if (!f->c.r && !f->c.w)
+        cursor_write(f);
+    if (f->c.w_end - f->c.w >= (ptrdiff_t) sz) {
+        memcpy(f->c.w, buf, sz);
+        f->c.w += sz;
+        return sz;
+    }
+    cursor_close(f);
+    if (f->lz)
+        return lz_write(f, buf, sz);
+    if (f->sbuf) {
+        struct iovec iov = { (char*) buf, sz };
+        if (stream_put(f, &iov, 1) == -1)
+            return -1;
+        f->pos += sz;
+        return sz;
+    }
+    if (f->dbuf)
+        return direct_write(f, buf, sz);
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        size_t n = sz - nwritten;
+        if (n >= RA_MAX * BLOCK_SIZE && f->mode == O_WRONLY) {
+            if (io61_flush(f) == -1 || seek_to(f, f->pos) == -1
+                || write_all(f, buf + nwritten, n) == -1)
+                break;
+            f->pos += n;
+            nwritten += n;
+            break;
+        }
 
-io61_file* io61_fdopen(int fd, int mode) {
-    assert(fd >= 0);
-    io61_file* f = (io61_file*) malloc(sizeof(io61_file));
-    //printf ("fdopen malloc %p\n", f);
-    f->fd = fd;
-    f->mode = mode;
-    assert(mode == O_RDONLY || mode == O_WRONLY);
-    f->pos = 0;
-    f->f_pos = 0;
-    f->f_size = io61_filesize(f);
-    int allowseek = !(lseek(f->fd, 0, SEEK_CUR) == (off_t) -1);
-    f->seq_mode = allowseek? -1 : 0;
-    for (int i=0; i < NSLOTS; ++i)
-        f->slots[i].block = f->slots[i].pos = -1;
-    return f;
+        int ofs = find_block_ofs(f->pos);
+        if (n > (size_t) (BLOCK_SIZE - ofs))
+            n = BLOCK_SIZE - ofs;
+        io61_block* b = find_block_data(f, find_block(f->pos), n == BLOCK_SIZE);
+        if (buffer_write(f, b, ofs, buf + nwritten, n) == -1)
+            break;
+        f->pos += n;
+        nwritten += n;
+    }
+    if (nwritten == 0 && sz != 0)
+        return -1;
+    return nwritten;
 }
 
 
-// io61_close(f)
-//    Close the io61_file `f` and release all its resources.
+// io61_readv(f, iov, iovcnt)
+//    Read into the `iovcnt` buffers in `iov`, filling each in turn, as if
+//    they were one buffer passed to io61_read(). Returns the number of
+//    characters read, which is short at end of file, or -1 if an error
+//    occurred before any characters were read.
+//    A request of at least RA_MAX blocks that starts outside the cache is
+//    read into the buffers with preadv(). Streams read through their
+//    stream buffer.
 
-int io61_close(io61_file* f) {
-    io61_flush(f);
-    int r = close(f->fd);
-    //printf ("fdclose free %p\n", f);
-    free(f);
-    return r;
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    cursor_close(f);
+    size_t sz = iov_size(iov, iovcnt), nread = 0;
+    ssize_t r = 0;
+    if (sz >= RA_MAX * BLOCK_SIZE && f->mode == O_RDONLY && !f->map
+        && !f->sbuf && !f->dbuf && !f->lz
+        && cache_lookup(f, find_block(f->pos)) < 0) {
+        struct iovec v[FLUSH_IOV];
+        while (iovcnt > 0) {
+            int n = iovcnt < FLUSH_IOV ? iovcnt : FLUSH_IOV;
+            memcpy(v, iov, n * sizeof(*v));
+            iov += n;
+            iovcnt -= n;
+            for (struct iovec* vp = v; n > 0; ) {
+                size_t zeroed = f->sparse ? hole_fill(f, f->pos, vp, n) : 0;
+                if (zeroed > 0) {
+                    f->pos += zeroed;
+                    nread += zeroed;
+                    n = iov_advance(&vp, n, zeroed);
+                    continue;
+                }
+                r = preadv(f->fd, vp, n, f->pos);
+                count_io(f, ST_READS, r);
+                if (r == -1 && errno == EINTR)
+                    continue;
+                if (r <= 0) {
+                    f->eof = (r == 0);
+                    goto done;
+                }
+                f->pos += r;
+                nread += r;
+                n = iov_advance(&vp, n, r);
+            }
+        }
+    } else
+        for (int i = 0; i != iovcnt; ++i) {
+            r = io61_read(f, (char*) iov[i].iov_base, iov[i].iov_len);
+            if (r > 0)
+                nread += r;
+            if (r != (ssize_t) iov[i].iov_len)
+                break;
+        }
+ done:
+    if (nread == 0 && r == -1 && sz != 0)
+        return -1;
+    return nread;
+}
+
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers in `iov` in order, as io61_write() would
+//    write them joined together. Returns the number of characters written,
+//    normally the total size of the buffers, or -1 if an error occurred
+//    before any characters were written.
+//    A request of at least RA_MAX blocks to a write-only file goes to the
+//    kernel with pwritev(), after any buffered data. Streams write through
+//    their stream buffer.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    cursor_close(f);
+    size_t sz = iov_size(iov, iovcnt), nwritten = 0;
+    if (f->sbuf) {
+        if (stream_put(f, iov, iovcnt) == -1)
+            return -1;
+        f->pos += sz;
+        return sz;
+    }
+    if (sz >= RA_MAX * BLOCK_SIZE && f->mode == O_WRONLY && !f->dbuf && !f->lz) {
+        if (io61_flush(f) == -1)
+            return -1;
+        struct iovec v[FLUSH_IOV];
+        while (iovcnt > 0) {
+            int n = iovcnt < FLUSH_IOV ? iovcnt : FLUSH_IOV;
+            memcpy(v, iov, n * sizeof(*v));
+            size_t vsz = iov_size(v, n);
+            if (write_run(f, f->pos, v, n) == -1)
+                break;
+            f->pos += vsz;
+            nwritten += vsz;
+            iov += n;
+            iovcnt -= n;
+        }
+    } else
+        for (int i = 0; i != iovcnt; ++i) {
+            ssize_t r = io61_write(f, (const char*) iov[i].iov_base,
+                                   iov[i].iov_len);
+            if (r > 0)
+                nwritten += r;
+            if (r != (ssize_t) iov[i].iov_len)
+                break;
+        }
+    if (nwritten == 0 && sz != 0)
+        return -1;
+    return nwritten;
 }
 
 
-// io61_readc(f)
-//    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+#define COPY_CHUNK ((size_t) 1 << 30)   // max bytes per system call
 
-int io61_readc(io61_file* f) {
-    /*unsigned char buf[1];
-    if (read(f->fd, buf, 1) == 1) {
-        return buf[0];
-    } else {
-        return EOF;
-    }*/
-    off_t new_block = find_block(f->pos);
-    off_t new_block_pos = find_block_pos(f->pos);
-    int new_block_ofs = find_block_ofs(f->pos);
-    int slotindex = find_slot(f->pos);
-    io61_slot* s = &f->slots[slotindex];
-
-    if (new_block != s->block)
-        // replace slot with new_block data
-        if (read_slot(f, slotindex, new_block)==EOF)
-            return EOF;
-
-    if (new_block_ofs >= s->sz) 
-        return EOF;
-    ++f->pos;
-    return s->buf[new_block_ofs];
+// copy methods, in the order tried
+#define COPY_RANGE 0
+#define COPY_SENDFILE 1
+#define COPY_SPLICE 2
+#define COPY_USER 3
+
+// copy_user(outf, inf, sz)
+//    io61_copy() through a user-space buffer
+static ssize_t copy_user(io61_file* outf, io61_file* inf, size_t sz) {
+    char buf[RA_MAX * BLOCK_SIZE];
+    size_t ncopied = 0;
+    while (ncopied != sz) {
+        size_t n = sz - ncopied < sizeof(buf) ? sz - ncopied : sizeof(buf);
+        ssize_t r = io61_read(inf, buf, n);
+        if (r <= 0 || io61_write(outf, buf, r) != r)
+            return ncopied ? (ssize_t) ncopied : (r == 0 ? 0 : -1);
+        ncopied += r;
+    }
+    return ncopied;
 }
 
+// is_pipe(f)
+//    return true if `f` is a pipe
+static int is_pipe(io61_file* f) {
+    struct stat s;
+    ++f->st->n[ST_OTHER];
+    return fstat(f->fd, &s) == 0 && S_ISFIFO(s.st_mode);
+}
 
-// io61_read(f, buf, sz)
-//    Read up to `sz` characters from `f` into `buf`. Returns the number of
-//    characters read on success; normally this is `sz`. Returns a short
-//    count, which might be zero, if the file ended before `sz` characters
-//    could be read. Returns -1 if an error occurred before any characters
-//    were read.
+// splice_all(in, outf, out_off, sz)
+//    splice() exactly `sz` bytes, which are known to be ready, from pipe
+//    `in` to `outf`
+static int splice_all(int in, io61_file* outf, off_t* out_off, size_t sz) {
+    while (sz > 0) {
+        ssize_t r = splice(in, NULL, outf->fd, out_off, sz, SPLICE_F_MOVE);
+        ++outf->st->n[ST_COPIES];
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        sz -= r;
+    }
+    return 0;
+}
 
-ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
-    size_t nread;
-    //printf ("%zd\n", sz);
-    if (f->seq_mode != 1) {
-	nread = read(f->fd, buf, sz);
-	//printf("loop1 \n");
-        return nread;
-    }
-    else if (sz > BLOCK_SIZE) {
-	if (f->seq_mode != 0) {
-	    int new_pos = lseek(f->fd, f->pos, SEEK_SET);
-            assert(new_pos != -1); 
-            f->f_pos = new_pos;
-	}
-	nread = read(f->fd, buf, sz);
-	f->f_pos += nread;
-	//printf("loop2\n");
-	return nread;
+// copy_kernel(outf, inf, sz, method, pfd)
+//    copy up to `sz` bytes with `method`, in one step, and update the file
+//    positions. `pfd` holds the intermediate pipe for COPY_SPLICE, created
+//    when first needed.
+static ssize_t copy_kernel(io61_file* outf, io61_file* inf, size_t sz,
+                           int method, int* pfd) {
+    off_t in_off = inf->pos, out_off = outf->pos;
+    off_t* inp = inf->seekable ? &in_off : NULL;
+    off_t* outp = outf->seekable ? &out_off : NULL;
+    ssize_t r;
+    if (method == COPY_RANGE) {
+        if (!inp || !outp) {
+            errno = EINVAL;
+            return -1;
+        }
+        r = copy_file_range(inf->fd, inp, outf->fd, outp, sz, 0);
+    } else if (method == COPY_SENDFILE) {
+        if (!inp || seek_to(outf, outf->pos) == -1) {
+            errno = EINVAL;
+            return -1;
+        }
+        r = sendfile(outf->fd, inf->fd, inp, sz);
+        if (r > 0)
+            outf->f_pos += r;
+    } else if (inf->async) {
+        // the read-ahead thread owns the file descriptor
+        errno = EINVAL;
+        return -1;
+    } else if (pfd[0] == -2) {
+        // one side is a pipe
+        r = splice(inf->fd, inp, outf->fd, outp, sz, SPLICE_F_MOVE);
+        if (r > 0 && !outp)
+            outf->f_pos += r;
     } else {
-        for (nread = 0; nread != sz; ++nread) {
-            int ch = io61_readc(f);
-            if (ch == EOF)
-                break;
-            buf[nread] = ch;
+        if (pfd[0] == -1) {
+            ++outf->st->n[ST_OTHER];
+            if (pipe(pfd) == -1)
+                return -1;
         }
-	//printf("loop3\n");
-        if (nread != 0 || sz == 0 || io61_eof(f)) {
-            return nread;
-        } 
-        else 
+        r = splice(inf->fd, inp, pfd[1], NULL, sz, SPLICE_F_MOVE);
+        if (r > 0 && splice_all(pfd[0], outf, outp, r) == -1) {
+            // the data is out of `inf` but stuck in the pipe
+            errno = EIO;
             return -1;
+        }
+        if (r > 0 && !outp)
+            outf->f_pos += r;
     }
-/*
-    size_t nread = 0;
-    while (nread != sz) {
-        int ch = io61_readc(f);
-        if (ch == EOF) {
+    ++outf->st->n[ST_COPIES];
+    if (r > 0) {
+        inf->st->n[ST_BYTES_READ] += r;
+        outf->st->n[ST_BYTES_WRITTEN] += r;
+        inf->pos += r;
+        if (!inf->seekable)
+            inf->f_pos += r;
+        outf->pos += r;
+    } else if (r == 0)
+        inf->eof = 1;
+    return r;
+}
+
+// io61_copy(outf, inf, sz)
+//    Copy up to `sz` characters from `inf` to `outf`, stopping early at end
+//    of file. Returns the number of characters copied, or -1 if an error
+//    occurred before any characters were copied.
+//    Data that `inf` has already taken from a stream and data buffered for
+//    `outf` go first. After that the kernel moves the data without copying
+//    it through user space: copy_file_range() between seekable files,
+//    sendfile() from a seekable file, and splice() otherwise (through a
+//    pipe if neither file is one).
+
+ssize_t io61_copy(io61_file* outf, io61_file* inf, size_t sz) {
+    cursor_close(outf);
+    cursor_close(inf);
+    // the kernel can't see compressed data or read/write files' cached
+    // blocks
+    if (outf->lz || inf->lz || outf->mode == O_RDWR || inf->mode == O_RDWR)
+        return copy_user(outf, inf, sz);
+    size_t ncopied = 0;
+    // data already read from a stream is only in our buffers
+    if (!inf->seekable && inf->f_pos > inf->pos) {
+        size_t n = inf->f_pos - inf->pos;
+        ssize_t r = copy_user(outf, inf, n < sz ? n : sz);
+        if (r <= 0)
+            return r;
+        ncopied += r;
+    }
+    if (ncopied == sz)
+        return ncopied;
+    // small copies are cheaper through our buffers, and the kernel copy
+    // calls refuse files opened for appending
+    ++outf->st->n[ST_OTHER];
+    if (sz - ncopied < BLOCK_SIZE || (fcntl(outf->fd, F_GETFL) & O_APPEND)) {
+        ssize_t r = copy_user(outf, inf, sz - ncopied);
+        if (r > 0)
+            ncopied += r;
+        return ncopied ? (ssize_t) ncopied : r;
+    }
+    if (io61_flush(outf) == -1)
+        return ncopied ? (ssize_t) ncopied : -1;
+
+    int pfd[2] = { -1, -1 };
+    if (is_pipe(inf) || is_pipe(outf))
+        pfd[0] = -2;    // splice directly
+    int method = COPY_RANGE;
+    while (ncopied != sz) {
+        size_t n = sz - ncopied < COPY_CHUNK ? sz - ncopied : COPY_CHUNK;
+        ssize_t r;
+        if (method == COPY_USER)
+            r = copy_user(outf, inf, n);
+        else
+            r = copy_kernel(outf, inf, n, method, pfd);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && method != COPY_USER
+            && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                || errno == EOPNOTSUPP || errno == EBADF
+                || errno == ESPIPE)) {
+            ++method;   // not supported for these files; try the next way
+            continue;
+        }
+        if (r <= 0) {
+            if (r == -1 && ncopied == 0)
+                ncopied = -1;
             break;
         }
-        buf[nread] = ch;
-        ++nread;
+        ncopied += r;
     }
-*/
+    if (pfd[0] >= 0) {
+        close(pfd[0]);
+        close(pfd[1]);
+        outf->st->n[ST_OTHER] += 2;
+    }
+    return ncopied;
+}
+
+
+// line merging
+//    io61_merge() merges sorted inputs with a loser tree over their current
+//    lines. Input `i` is leaf `k + i` of a complete binary tree whose
+//    internal nodes 1..k-1 each hold the input that lost the match played
+//    there; node 0 holds the overall winner. Taking a line from the winner
+//    and replaying its path to the root costs log2(k) comparisons.
+//    Each input's current line stays where io61_readline() put it (a
+//    pinned cache block, the mapping or the stream buffer), so lines are
+//    written out without being copied. Regular files are double buffered:
+//    the kernel is asked to read the MERGE_AHEAD / 2 bytes after the half
+//    an input is reading, so one half fills while the merge drains the
+//    other, and mapped pages already merged are dropped, so a many-way
+//    merge's resident size stays near k * MERGE_AHEAD.
+
+#define MERGE_AHEAD (64 * BLOCK_SIZE)   // read-ahead window per input
+
+typedef struct io61_merge_input {
+    io61_file* f;
+    const char* line;   // current line, or NULL once `f` is exhausted
+    size_t len;         // length of `line`, including its newline
+    off_t ahead;        // end of the read-ahead requested so far
+    off_t dropped;      // end of the mapped pages dropped so far
+} io61_merge_input;
 
+// merge_less(in, a, b)
+//    return true if input `a`'s line sorts before input `b`'s: bytewise,
+//    ignoring newlines, with exhausted inputs last and ties going to the
+//    earlier input (which makes the merge stable)
+static int merge_less(const io61_merge_input* in, int a, int b) {
+    if (!in[a].line || !in[b].line)
+        return in[b].line ? 0 : in[a].line || a < b;
+    size_t alen = in[a].len - (in[a].line[in[a].len - 1] == '\n');
+    size_t blen = in[b].len - (in[b].line[in[b].len - 1] == '\n');
+    int c = memcmp(in[a].line, in[b].line, alen < blen ? alen : blen);
+    if (c == 0)
+        c = (alen > blen) - (alen < blen);
+    return c < 0 || (c == 0 && a < b);
 }
 
+// merge_replay(in, t, k, i)
+//    input `i`'s line changed; replay its matches up to the root of loser
+//    tree `t`. While the tree is being built, an empty node (-1) keeps the
+//    input that reaches it and ends the replay.
+static void merge_replay(const io61_merge_input* in, int* t, int k, int i) {
+    int winner = i;
+    for (int node = (k + i) / 2; node > 0; node /= 2) {
+        if (t[node] < 0) {
+            t[node] = winner;
+            return;
+        }
+        if (merge_less(in, t[node], winner)) {
+            int loser = winner;
+            winner = t[node];
+            t[node] = loser;
+        }
+    }
+    t[0] = winner;
+}
 
-// io61_writec(f)
-//    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+// merge_next(m)
+//    read input `m`'s next line, first asking the kernel for the next half
+//    of its read-ahead window if it has started on the last half asked
+//    for, and dropping the mapped pages before the half it is leaving.
+//    Returns 1, 0 at end of file, or -1 on error.
+static int merge_next(io61_merge_input* m) {
+    io61_file* f = m->f;
+    if (f->seekable && !f->lz && !f->dbuf && f->pos < f->f_size
+        && f->pos >= m->ahead - MERGE_AHEAD / 2) {
+        off_t from = m->ahead > f->pos ? m->ahead : f->pos;
+        posix_fadvise(f->fd, from, MERGE_AHEAD / 2, POSIX_FADV_WILLNEED);
+        ++f->st->n[ST_HINTS];
+        m->ahead = from + MERGE_AHEAD / 2;
 
-int io61_writec(io61_file* f, int ch) {
-    /*
-    unsigned char buf[1];
-    buf[0] = ch;
-    if (write(f->fd, buf, 1) == 1) {
-        return 0;
+        off_t page = sysconf(_SC_PAGESIZE);
+        off_t done = (f->pos - MERGE_AHEAD / 2) & ~(page - 1);
+        off_t lo = m->dropped > f->map_pos ? m->dropped : f->map_pos;
+        if (done > f->map_pos + (off_t) f->map_sz)
+            done = f->map_pos + f->map_sz;
+        if (f->map && done > lo) {
+            madvise(f->map + (lo - f->map_pos), done - lo, MADV_DONTNEED);
+            ++f->st->n[ST_HINTS];
+            m->dropped = done;
+        }
     }
-    else {
+    int r = io61_readline(f, &m->line, &m->len);
+    if (r <= 0)
+        m->line = NULL;
+    return r;
+}
+
+// io61_merge(outf, inf, k)
+//    Merge the lines of the `k` files in `inf`, each sorted bytewise, into
+//    `outf`, and return the number of characters written, or -1 on error.
+//    Lines are compared without their newlines, and equal lines are
+//    written in the order of the files holding them. A last line without
+//    a newline gets one. `k` must be between 1 and IO61_MERGE_MAX.
+
+ssize_t io61_merge(io61_file* outf, io61_file** inf, int k) {
+    if (k < 1 || k > IO61_MERGE_MAX) {
+        errno = EINVAL;
         return -1;
-    } */
-    int slotindex = find_slot(f->pos);
-    io61_slot* s = &f->slots[slotindex];
-    //s->buf[BLOCK_SIZE+1]=0;printf("[%s]\n",s->buf);
-    off_t new_block = find_block(f->pos);
-    off_t new_block_pos = find_block_pos(f->pos);
-    int new_block_ofs = find_block_ofs(f->pos);
-    if (new_block_ofs == 0)
-        io61_flush (f);
-
-    if (s->pos == -1) { // empty slot, initialize
-        s->block = find_block(f->pos);
-        s->pos = find_block_pos(f->pos);
-        s->sz = 0;
-    }
-    //if (f->pos < s->pos || f->pos >= s->pos + s->sz) {
-    if (new_block != s->block) {
-        // flush cached data before reuse
-        if (s->sz && s->pos >= 0) {
-            //if (f->allowseek && f->f_pos != s->pos) { // if not allowseek, file only allows seq writing
-            if (f->seq_mode != 1)
-                assert(s->pos == f->f_pos);
-            else 
-                if (f->f_pos != s->pos) { 
-                    int new_pos = lseek(f->fd, s->pos, SEEK_SET);
-                    //if (s->pos == 0)
-                        //printf ("write():lseek %d %d\n", s->pos, new_pos);
-                    assert(new_pos != -1);
-                    f->f_pos = new_pos;
-                }
-            ssize_t r = write(f->fd, s->buf, s->sz);
-//printf("wrbuffer %ld, %ld \n", s->pos, s->sz);
-            if (r <= 0)
-                return -1;
-            f->f_pos += r; // keep track of real file position
-            s->block = new_block;
-            s->pos = new_block_pos;
-            s->sz = 0;
-            memset(s->buf, 0, BLOCK_SIZE); //reset content to be safe for random write
-        }
     }
-    s->buf[new_block_ofs] = (unsigned char) ch;
-    if (new_block_ofs+1 > s->sz)
-        s->sz = new_block_ofs+1;
-    ++f->pos;
-    return 0;
+    io61_merge_input in[IO61_MERGE_MAX];
+    int t[IO61_MERGE_MAX];
+    for (int i = 0; i < k; ++i) {
+        in[i].f = inf[i];
+        in[i].ahead = 0;
+        in[i].dropped = 0;
+        t[i] = -1;
+    }
+    for (int i = 0; i < k; ++i) {
+        if (merge_next(&in[i]) < 0)
+            return -1;
+        merge_replay(in, t, k, i);
+    }
+
+    size_t nwritten = 0;
+    while (in[t[0]].line) {
+        io61_merge_input* m = &in[t[0]];
+        if (io61_write(outf, m->line, m->len) != (ssize_t) m->len
+            || (m->line[m->len - 1] != '\n' && io61_writec(outf, '\n') == -1))
+            return -1;
+        nwritten += m->len + (m->line[m->len - 1] != '\n');
+        if (merge_next(m) < 0)
+            return -1;
+        merge_replay(in, t, k, t[0]);
+    }
+    return nwritten;
 }
 
 
-// io61_write(f, buf, sz)
-//    Write `sz` characters from `buf` to `f`. Returns the number of
-//    characters written on success; normally this is `sz`. Returns -1 if
-//    an error occurred before any characters were written.
+// concurrent readers
+//    io61_pread() reads at a given position without using or moving the
+//    file position, and any number of threads may call it on one read-only
+//    file at once, as long as nothing else uses the file meanwhile. It
+//    never takes a lock. A file mapped whole is read from the mapping.
+//    Other files read through a table of SHARED_SLOTS blocks of their own,
+//    where block `b` can only live in slot `b % SHARED_SLOTS`. Each slot has
+//    a sequence number (a seqlock) that is odd while the slot is being
+//    filled: a reader copies the data and then checks that the number
+//    hasn't changed, and a filler claims the slot by making the number odd
+//    with compare-and-swap. A thread that loses that race reads from the
+//    kernel rather than wait.
 
-ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
-    size_t nwritten;
-    if (f->seq_mode != 1) {
-    	nwritten = write(f->fd, buf, sz);
-    	return nwritten;
-    } else {
-        if (!sz)
+#define SHARED_SLOTS 256        // blocks per file (1 MiB)
+
+typedef struct io61_slot {
+    unsigned long seq;      // even when stable, odd while being filled
+    off_t block;            // block held, or -1
+    ssize_t sz;             // bytes of data in the block
+    int ahead;              // read ahead and not used yet
+} io61_slot;
+
+typedef struct io61_shared {
+    io61_slot slot[SHARED_SLOTS];
+    unsigned char* data;    // SHARED_SLOTS blocks, aligned for O_DIRECT
+} io61_shared;
+
+// count_shared(f, stat, n)
+//    add `n` to a counter of `f` that other threads may be updating
+static inline void count_shared(io61_file* f, int stat, unsigned long long n) {
+    __atomic_fetch_add(&f->st->n[stat], n, __ATOMIC_RELAXED);
+}
+
+// shared_start(f)
+//    return `f`'s slot table, creating it if this is the first use
+static io61_shared* shared_start(io61_file* f) {
+    io61_shared* sh = __atomic_load_n(&f->shared, __ATOMIC_ACQUIRE);
+    if (sh)
+        return sh;
+    io61_shared* p = (io61_shared*) malloc(sizeof(io61_shared));
+    if (!p || !(p->data = (unsigned char*)
+                aligned_alloc(BLOCK_SIZE, SHARED_SLOTS * BLOCK_SIZE))) {
+        free(p);
+        return NULL;
+    }
+    for (int i = 0; i < SHARED_SLOTS; ++i) {
+        p->slot[i].seq = 0;
+        p->slot[i].block = -1;
+        p->slot[i].sz = 0;
+        p->slot[i].ahead = 0;
+    }
+    // another thread may have beaten us to it
+    if (__atomic_compare_exchange_n(&f->shared, &sh, p, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return p;
+    free(p->data);
+    free(p);
+    return sh;
+}
+
+// shared_free(f)
+//    free `f`'s slot table
+static void shared_free(io61_file* f) {
+    io61_shared* sh = f->shared;
+    if (!sh)
+        return;
+    for (int i = 0; i < SHARED_SLOTS; ++i)
+        if (sh->slot[i].ahead)
+            ++f->st->n[ST_PREFETCH_WASTED];
+    free(sh->data);
+    free(sh);
+    f->shared = NULL;
+}
+
+// shared_get(f, sh, block, ofs, buf, sz)
+//    copy up to `sz` bytes at offset `ofs` of block `block` to `buf`, if
+//    its slot has it. Returns the number of bytes copied, 0 if the block
+//    ends at `ofs`, or -1 if the slot doesn't hold the block.
+static ssize_t shared_get(io61_file* f, io61_shared* sh, off_t block, int ofs,
+                          char* buf, size_t sz) {
+    int i = block % SHARED_SLOTS;
+    io61_slot* s = &sh->slot[i];
+    unsigned long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || __atomic_load_n(&s->block, __ATOMIC_RELAXED) != block)
+        return -1;
+    ssize_t n = __atomic_load_n(&s->sz, __ATOMIC_RELAXED) - ofs;
+    if (n < 0)
+        n = 0;
+    if ((size_t) n > sz)
+        n = sz;
+    memcpy(buf, sh->data + (size_t) i * BLOCK_SIZE + ofs, n);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+        return -1;
+    count_shared(f, ST_HITS, 1);
+    int ahead = 1;
+    if (__atomic_load_n(&s->ahead, __ATOMIC_RELAXED)
+        && __atomic_compare_exchange_n(&s->ahead, &ahead, 0, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        count_shared(f, ST_PREFETCH_USED, 1);
+    return n;
+}
+
+// shared_fill(f, sh, block)
+//    read block `block` of `f` into its slot with one system call, along
+//    with the blocks after it if the block before is there (someone is
+//    scanning the file). Stops at slots other threads are filling and at
+//    blocks already there. Returns 0 on success, 1 if `block`'s own slot
+//    is busy, or -1 if the read failed.
+static int shared_fill(io61_file* f, io61_shared* sh, off_t block) {
+    int want = 1;
+    if (block > 0 && __atomic_load_n(&sh->slot[(block - 1) % SHARED_SLOTS].block,
+                                     __ATOMIC_RELAXED) == block - 1)
+        want = RA_MAX;
+    if (f->f_size != -1 && block + want > find_block(f->f_size - 1) + 1)
+        want = find_block(f->f_size - 1) + 1 - block;
+    struct iovec iov[RA_MAX];
+    unsigned long seq[RA_MAX];
+    int n = 0;
+    while (n < want) {
+        io61_slot* s = &sh->slot[(block + n) % SHARED_SLOTS];
+        seq[n] = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+        if ((seq[n] & 1)
+            || (n > 0 && __atomic_load_n(&s->block, __ATOMIC_RELAXED) == block + n)
+            || !__atomic_compare_exchange_n(&s->seq, &seq[n], seq[n] + 1, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        iov[n].iov_base = sh->data + (size_t) ((block + n) % SHARED_SLOTS) * BLOCK_SIZE;
+        iov[n].iov_len = BLOCK_SIZE;
+        ++n;
+    }
+    if (n == 0)
+        return 1;
+    // readers must see the odd numbers before the slots change
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ssize_t r;
+    do {
+        r = preadv(f->fd, iov, n, block * BLOCK_SIZE);
+        count_shared(f, ST_READS, 1);
+    } while (r == -1 && errno == EINTR);
+    if (r > 0)
+        count_shared(f, ST_BYTES_READ, r);
+    count_shared(f, ST_MISSES, 1);
+
+    size_t left = r > 0 ? r : 0;
+    for (int k = 0; k < n; ++k) {
+        io61_slot* s = &sh->slot[(block + k) % SHARED_SLOTS];
+        size_t take = left < BLOCK_SIZE ? left : BLOCK_SIZE;
+        left -= take;
+        int ahead = k > 0 && take > 0;
+        if (__atomic_exchange_n(&s->ahead, ahead, __ATOMIC_RELAXED))
+            count_shared(f, ST_PREFETCH_WASTED, 1);
+        if (ahead)
+            count_shared(f, ST_PREFETCHED, 1);
+        __atomic_store_n(&s->sz, (ssize_t) take, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->block, r >= 0 && (k == 0 || take > 0) ? block + k : -1,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&s->seq, seq[k] + 2, __ATOMIC_RELEASE);
+    }
+    return r == -1 ? -1 : 0;
+}
+
+// io61_pread(f, buf, sz, off)
+//    Read up to `sz` characters from read-only file `f`, starting at
+//    position `off`, into `buf`. Returns the number of characters read,
+//    which is short at end of file, or -1 if an error occurred before any
+//    characters were read. Doesn't use or change the file position.
+//    Many threads may call io61_pread() on `f` at once, but no other
+//    function may use `f` meanwhile.
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    if (f->lz)
+        return lz_pread(f, buf, sz, off);
+    if (f->mode != O_RDONLY || !f->seekable || off < 0) {
+        errno = f->mode != O_RDONLY ? EBADF : !f->seekable ? ESPIPE : EINVAL;
+        return -1;
+    }
+    if (f->f_size != -1) {
+        if (off >= f->f_size)
             return 0;
-        for (nwritten = 0; nwritten != sz; ++nwritten)
-            if (io61_writec(f, buf[nwritten]) == -1) 
-                return -1;
-        return nwritten;
+        if (sz > (size_t) (f->f_size - off))
+            sz = f->f_size - off;
+    }
+    if (f->map && f->map_pos == 0 && (off_t) f->map_sz == f->f_size) {
+        memcpy(buf, f->map + off, sz);
+        return sz;
+    }
+
+    io61_shared* sh = shared_start(f);
+    size_t nread = 0;
+    ssize_t r = 0;
+    while (nread != sz) {
+        off_t block = find_block(off + nread);
+        int ofs = find_block_ofs(off + nread);
+        size_t n = sz - nread;
+        if (n > (size_t) (BLOCK_SIZE - ofs))
+            n = BLOCK_SIZE - ofs;
+        r = -1;
+        if (sh && (r = shared_get(f, sh, block, ofs, buf + nread, n)) == -1) {
+            int fill = shared_fill(f, sh, block);
+            if (fill == -1)
+                break;
+            if (fill == 0)
+                r = shared_get(f, sh, block, ofs, buf + nread, n);
+            // O_DIRECT needs aligned memory, so wait for the slot
+            if (r == -1 && f->dbuf) {
+                sched_yield();
+                continue;
+            }
+        }
+        if (r == -1) {
+            // the slot is busy: go around the table
+            do {
+                r = pread(f->fd, buf + nread, n, off + nread);
+                count_shared(f, ST_READS, 1);
+            } while (r == -1 && errno == EINTR);
+            if (r > 0)
+                count_shared(f, ST_BYTES_READ, r);
+        }
+        if (r <= 0)
+            break;
+        nread += r;
     }
+    if (nread == 0 && r == -1 && sz != 0)
+        return -1;
+    return nread;
+}
+
+
+// compare blocks by file position, for io61_flush
+static int block_compare(const void* a, const void* b) {
+    off_t x = cache.blocks[*(const int*) a].block;
+    off_t y = cache.blocks[*(const int*) b].block;
+    return x < y ? -1 : x > y;
 }
 
 // io61_flush(f)
@@ -334,45 +4256,149 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 //    data buffered for reading, or do nothing.
 
 int io61_flush(io61_file* f) {
-    //(void)f;
-    if (f->mode == O_WRONLY)
-        for (int i = 0; i < NSLOTS; i++)
-            flush_slot(f, i);
+    cursor_close(f);
+    if (f->lz)
+        return lz_flush(f);
+    if (f->dbuf && f->mode == O_WRONLY)
+        return direct_flush(f);
+    if (f->sbuf && f->mode == O_WRONLY) {
+        int r = f->werror ? -1 : 0;
+        f->werror = 0;
+        if (f->s_len > 0 && stream_write(f, NULL, 0) == -1)
+            r = -1;
+        return r;
+    }
+    if (f->mode == O_RDONLY)
+        return 0;
 
-    return 0;
+    // write dirty blocks in file order, coalescing adjacent ones
+    int dirty[CACHE_BLOCKS];
+    int n = 0;
+    for (int i = f->head; i >= 0; i = cache.blocks[i].fnext)
+        if (cache.blocks[i].ndirty > 0)
+            dirty[n++] = i;
+    qsort(dirty, n, sizeof(int), block_compare);
+    int r = flush_blocks(f, dirty, n, 1);
+    if (uring_drain(f) == -1)
+        r = -1;
+    // only now is nothing left that could extend the file past holes
+    if (hole_extend(f) == -1)
+        r = -1;
+    return r;
 }
 
 
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
-//    any call means no longer sequencial r/w, change cached f->pos only. lseek() delayed ro real r/w of cache
+//    Only the cached f->pos changes; real I/O happens when data is needed.
 
 int io61_seek(io61_file* f, off_t pos) {
-    if (f->mode==O_RDONLY && f->f_size != -1 && pos > f->f_size)
+    cursor_sync(f);
+    if (!f->seekable && pos != f->pos)
         return -1;
-	else {
-        f->pos = pos;
-        if (f->seq_mode != 1)
-            f->seq_mode = 1;
-        return 0;
-    } 
+    if (f->mode == O_RDONLY && f->f_size != -1 && pos > f->f_size)
+        return -1;
+    // a read cursor can move anywhere in its buffer
+    if (f->c.r && pos >= f->pos - (f->c_start - f->c_lo)
+        && pos <= f->pos + (f->c.r_end - f->c_start))
+        f->c.r = f->c_start = f->c_start + (pos - f->pos);
+    else
+        cursor_close(f);
+    if (pos != f->pos && !f->lz)
+        detect_seek(f, pos);
+    f->pos = pos;
+    ++f->st->n[ST_SEEKS];
+    if (f->seek_owed)
+        ++f->st->n[ST_SEEKS_ELIDED];
+    f->seek_owed = 1;
+    return 0;
+}
+
+
+// stats_append(buf, sz, len, format, ...)
+//    snprintf() at `buf + len`, where `buf` holds `sz` bytes. Returns the
+//    new length, which keeps growing past `sz` like snprintf()'s does.
+static size_t stats_append(char* buf, size_t sz, size_t len,
+                           const char* format, ...) {
+    va_list val;
+    va_start(val, format);
+    int n = vsnprintf(len < sz ? buf + len : NULL, len < sz ? sz - len : 0,
+                      format, val);
+    va_end(val);
+    return len + (n > 0 ? n : 0);
 }
 
+// stats_object(buf, sz, len, name, n)
+//    append a JSON object with counts `n`, named `name` unless it's NULL
+static size_t stats_object(char* buf, size_t sz, size_t len,
+                           const char* name, const unsigned long long* n) {
+    unsigned long long ncalls = 0;
+    for (int k = 0; k < ST_NCALLS; ++k)
+        ncalls += n[k];
+    if (name)
+        len = stats_append(buf, sz, len, "{\"file\":\"%s\",", name);
+    else
+        len = stats_append(buf, sz, len, "{");
+    len = stats_append(buf, sz, len, "\"syscalls\":%llu", ncalls);
+    for (int k = 0; k < NSTATS; ++k)
+        len = stats_append(buf, sz, len, ",\"%s\":%llu", stat_names[k], n[k]);
+    // compression ratio and codec throughput
+    if (n[ST_LZ_RAW] > 0 && n[ST_LZ_PACKED] > 0)
+        len = stats_append(buf, sz, len, ",\"lz_ratio\":%.3f,\"lz_mb_per_sec\":%.1f",
+                           (double) n[ST_LZ_RAW] / n[ST_LZ_PACKED],
+                           n[ST_LZ_USEC] ? (double) n[ST_LZ_RAW] / n[ST_LZ_USEC]
+                           : 0.0);
+    return stats_append(buf, sz, len, "}");
+}
+
+// io61_stats_json(buf, sz)
+//    Write a JSON object with the I/O counts of each file opened so far,
+//    and their totals, to `buf`, which holds `sz` bytes, the way snprintf()
+//    would. Returns the length of the whole object. The totals come last,
+//    so a reader that keeps the last value of each key sees them.
+
+size_t io61_stats_json(char* buf, size_t sz) {
+    unsigned long long total[NSTATS] = { 0 };
+    int nrec = stats.nfiles < STATS_FILES ? stats.nfiles : STATS_FILES;
+    size_t len = stats_append(buf, sz, 0, "{\"files\":[");
+    for (int i = 0; i <= nrec; ++i) {
+        io61_stats* st = i < nrec ? &stats.file[i] : &stats.misc;
+        int used = i < nrec;
+        for (int k = 0; k < NSTATS; ++k) {
+            total[k] += st->n[k];
+            used = used || st->n[k] != 0;
+        }
+        if (used) {
+            if (i > 0)
+                len = stats_append(buf, sz, len, ",");
+            len = stats_object(buf, sz, len, i < nrec ? st->name : "(io61)",
+                               st->n);
+        }
+    }
+    len = stats_append(buf, sz, len, "],\"total\":");
+    len = stats_object(buf, sz, len, NULL, total);
+    return stats_append(buf, sz, len, "}");
+}
 
-// You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
 //    Open the file corresponding to `filename` and return its io61_file.
 //    If `filename == NULL`, returns either the standard input or the
 //    standard output, depending on `mode`. Exits with an error message if
-//    `filename != NULL` and the named file cannot be opened.
+//    `filename != NULL` and the named file cannot be opened. The io61
+//    flags in `mode` are not passed to open(): IO61_DIRECT asks for
+//    O_DIRECT where the file system allows it, and IO61_COMPRESS or
+//    IO61_CHECKSUM reads or writes the framed block format (see lz_open()).
 
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
-    //printf("io61_open_check [%s] [%d]\n", filename, mode);
     if (filename) {
-        fd = open(filename, mode, 0666);
+        int flags = mode & ~(IO61_DIRECT | IO61_COMPRESS | IO61_CHECKSUM);
+        fd = open(filename, flags | (mode & IO61_DIRECT ? O_DIRECT : 0), 0666);
+        // not every file system can do O_DIRECT
+        if (fd < 0 && errno == EINVAL && (mode & IO61_DIRECT))
+            fd = open(filename, flags, 0666);
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
@@ -382,7 +4408,20 @@ io61_file* io61_open_check(const char* filename, int mode) {
         fprintf(stderr, "%s: %s\n", filename, strerror(errno));
         exit(1);
     }
-    return io61_fdopen(fd, mode & O_ACCMODE);
+    io61_file* f = io61_fdopen(fd, mode & O_ACCMODE);
+    if (filename)
+        stats_name(f, filename);
+    if (mode & (IO61_COMPRESS | IO61_CHECKSUM)) {
+        assert((mode & O_ACCMODE) != O_RDWR);
+        const char* name = filename ? filename : f->st->name;
+        f = lz_open(f, name, mode);
+        if (!f) {
+            fprintf(stderr, "%s: Not an io61 %s file\n", name,
+                    mode & IO61_COMPRESS ? "compressed" : "checksummed");
+            exit(1);
+        }
+    }
+    return f;
 }
 
 
@@ -391,9 +4430,16 @@ io61_file* io61_open_check(const char* filename, int mode) {
 //    well-defined size (for instance, if it is a pipe).
 
 off_t io61_filesize(io61_file* f) {
+    if (f->lz)
+        return f->f_size;
+    cursor_sync(f);
     struct stat s;
     int r = fstat(f->fd, &s);
+    ++f->st->n[ST_OTHER];
     if (r >= 0 && S_ISREG(s.st_mode)) {
+        // a read/write file may have grown in its cache
+        if (f->mode == O_RDWR && f->f_size > s.st_size)
+            return f->f_size;
         return s.st_size;
     } else {
         return -1;
@@ -406,13 +4452,5 @@ off_t io61_filesize(io61_file* f) {
 //    immediately after a `read` call that returned 0 or -1.
 
 int io61_eof(io61_file* f) {
-    char x;
-    ssize_t nread = read(f->fd, &x, 1);
-    if (nread == 1) {
-        fprintf(stderr, "Error: io61_eof called improperly\n\
-  (Only call immediately after a read() that returned 0 or -1.)\n");
-        abort();
-    }
-    return nread == 0;
+    return f->eof;
 }
-
@@ -6,27 +6,69 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 typedef struct io61_file io61_file;
 io61_file* io61_fdopen(int fd, int mode);
 io61_file* io61_open_check(const char* filename, int mode);
+#define IO61_DIRECT 0x40000000  // io61_open_check() flag: bypass page cache
+#define IO61_COMPRESS 0x20000000 // io61_open_check() flag: LZ block format
+#define IO61_CHECKSUM 0x10000000 // io61_open_check() flag: CRC-32C per block
 int io61_close(io61_file* f);
 
 off_t io61_filesize(io61_file* f);
 
 int io61_seek(io61_file* f, off_t pos);
 
-int io61_readc(io61_file* f);
-int io61_writec(io61_file* f, int ch);
+int io61_readc_slow(io61_file* f);
+int io61_writec_slow(io61_file* f, int ch);
+
+// io61_cursor
+//    Every io61_file starts with a cursor into its buffer, so that
+//    io61_readc() and io61_writec() need no function call until the
+//    buffer runs out. The next characters to read are [r, r_end); the next
+//    characters written go to [w, w_end). Empty ranges (such as two NULLs)
+//    send every call to io61_readc_slow() or io61_writec_slow().
+typedef struct io61_cursor {
+    unsigned char* r;
+    unsigned char* r_end;
+    unsigned char* w;
+    unsigned char* w_end;
+} io61_cursor;
+
+static inline int io61_readc(io61_file* f) {
+    io61_cursor* c = (io61_cursor*) f;
+    if (c->r != c->r_end) {
+        return *c->r++;
+    }
+    return io61_readc_slow(f);
+}
+
+static inline int io61_writec(io61_file* f, int ch) {
+    io61_cursor* c = (io61_cursor*) f;
+    if (c->w != c->w_end) {
+        *c->w++ = ch;
+        return 0;
+    }
+    return io61_writec_slow(f, ch);
+}
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_copy(io61_file* outf, io61_file* inf, size_t sz);
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off);
+int io61_readline(io61_file* f, const char** linep, size_t* lenp);
+#define IO61_MERGE_MAX 64       // io61_merge(): max input files
+ssize_t io61_merge(io61_file* outf, io61_file** inf, int k);
 
 int io61_eof(io61_file* f);
 int io61_flush(io61_file* f);
 
 void io61_profile_begin(void);
 void io61_profile_end(void);
+size_t io61_stats_json(char* buf, size_t sz);
 
 
 typedef struct {
@@ -34,6 +76,14 @@ typedef struct {
     size_t block_size;          // `-b` option: block size. Defaults to 0
     size_t stride;              // `-t` option: stride. Defaults to 1
     const char* output_file;    // `-o` option: output file. Defaults to NULL
+    int zero_copy;              // `-z` option: copy with io61_copy. Defaults to 0
+    int direct;                 // `-D` option: open with IO61_DIRECT. Defaults to 0
+    int nthreads;               // `-j` option: number of threads. Defaults to 1
+    const char* transform;      // `-x` option: transform name. Defaults to NULL
+    int decompress;             // `-d` option: decompress. Defaults to 0
+    int checksum;               // `-k` option: checksum. Defaults to 0
+    size_t memory;              // `-S` option: memory budget, which may end
+                                // in K, M or G. Defaults to 0
     const char* input_file;     // input file. Defaults to NULL
     int n_input_files;          // number of input files; at least 1
     const char** input_files;   // all input files; NULL-terminated array
@@ -0,0 +1,44 @@
+#include "io61.h"
+
+// Usage: ./lz61 [-b BLOCKSIZE] [-o OUTFILE] [-k] [-d] [FILE]
+//    Copies FILE to OUTFILE in blocks, compressing it into io61's framed
+//    block format (IO61_COMPRESS). With -k, the blocks are stored as they
+//    are, each with a checksum (IO61_CHECKSUM). With -d, decodes FILE,
+//    written either way, instead, and fails on a block that doesn't match
+//    its checksum. The stdio versions ignore both flags, so only a round
+//    trip gives the same output as this one.
+//    Default BLOCKSIZE is 65536.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args = io61_parse_arguments(argc, argv, "b:o:kd");
+    size_t block_size = args.block_size ? args.block_size : 65536;
+
+    // Allocate buffer, open files
+    char* buf = (char*) malloc(block_size);
+
+    io61_profile_begin();
+    int format = args.checksum ? IO61_CHECKSUM : IO61_COMPRESS;
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY
+                                     | (args.decompress ? format : 0));
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC
+                                      | (args.decompress ? 0 : format));
+
+    // Copy file data
+    while (1) {
+        ssize_t amount = io61_read(inf, buf, block_size);
+        if (amount < 0) {
+            perror("lz61");
+            exit(1);
+        } else if (amount == 0) {
+            break;
+        }
+        io61_write(outf, buf, amount);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+    free(buf);
+}
@@ -0,0 +1,35 @@
+#include "io61.h"
+
+// Usage: ./merge61 [-o OUTFILE] [FILE1 FILE2...]
+//    Merges the lines of the input FILEs, each of which must already be
+//    sorted bytewise (like `LC_ALL=C sort`), into one sorted OUTFILE with
+//    io61_merge. Equal lines come out in the order of the FILEs that hold
+//    them. This is the merge step of an external merge sort.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args = io61_parse_arguments(argc, argv, "o:#");
+
+    // Open files
+    int nfiles = args.n_input_files;
+    io61_profile_begin();
+    io61_file** infs = (io61_file**) calloc(nfiles, sizeof(io61_file*));
+    for (int i = 0; i < nfiles; ++i) {
+        infs[i] = io61_open_check(args.input_files[i], O_RDONLY);
+    }
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Merge
+    if (io61_merge(outf, infs, nfiles) < 0) {
+        perror("merge61");
+        exit(1);
+    }
+
+    for (int i = 0; i < nfiles; ++i) {
+        io61_close(infs[i]);
+    }
+    io61_close(outf);
+    io61_profile_end();
+    free(infs);
+}
@@ -0,0 +1,52 @@
+#include "io61.h"
+#include <ctype.h>
+
+// Usage: ./patch61 [-b RECORDSIZE] [-r RANDOMSEED] FILE
+//    Updates FILE in place, a record at a time: reads a record, swaps
+//    the case of its letters, and writes it back where it was. Records
+//    are chosen at random, as many times as FILE has records, so some
+//    are patched more than once and some not at all. Opens FILE with
+//    O_RDWR. Default RECORDSIZE is 128.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    srandom(61432);
+    io61_arguments args = io61_parse_arguments(argc, argv, "b:r:");
+    size_t record_size = args.block_size ? args.block_size : 128;
+    if (!args.input_file) {
+        fprintf(stderr, "Usage: ./patch61 [-b RECORDSIZE] [-r RANDOMSEED] FILE\n");
+        exit(1);
+    }
+
+    // Allocate buffer, open file, measure file size
+    char* buf = (char*) malloc(record_size);
+
+    io61_profile_begin();
+    io61_file* f = io61_open_check(args.input_file, O_RDWR);
+    off_t size = io61_filesize(f);
+    if (size < 0) {
+        fprintf(stderr, "patch61: can't get size of file\n");
+        exit(1);
+    }
+
+    // Patch records
+    size_t nrecords = (size + record_size - 1) / record_size;
+    for (size_t n = 0; n != nrecords; ++n) {
+        off_t pos = (random() % nrecords) * record_size;
+        io61_seek(f, pos);
+        ssize_t amount = io61_read(f, buf, record_size);
+        if (amount <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i != amount; ++i) {
+            unsigned char ch = buf[i];
+            buf[i] = isupper(ch) ? tolower(ch) : toupper(ch);
+        }
+        io61_seek(f, pos);
+        io61_write(f, buf, amount);
+    }
+
+    io61_close(f);
+    io61_profile_end();
+    free(buf);
+}
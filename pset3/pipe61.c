@@ -0,0 +1,365 @@
+#include "io61.h"
+#include <pthread.h>
+#include <sched.h>
+
+// Usage: ./pipe61 [-j NTHREADS] [-b BLOCKSIZE] [-x TRANSFORM] [-o OUTFILE] [FILE]
+//    Runs FILE through a pipeline of threads. The main thread reads the
+//    input in chunks of BLOCKSIZE bytes, NTHREADS worker threads apply
+//    TRANSFORM to the chunks in parallel, and a writer thread puts the
+//    chunks back in order and writes the results to OUTFILE. The stages
+//    are connected by bounded lock-free queues. TRANSFORM is one of:
+//        cat     copy the input (the default)
+//        upper   copy the input, changing letters to upper case
+//        lower   copy the input, changing letters to lower case
+//        lines   print the number of lines
+//        sum     print the number of lines and bytes and the checksum
+//                that `pscan61` prints
+//    Default NTHREADS is 1 and default BLOCKSIZE is 1048576.
+
+
+// chunk
+//    A buffer making its way through the pipeline.
+
+typedef struct chunk {
+    unsigned long long seq;     // chunk number, in file order
+    off_t pos;                  // file position of `buf[0]`
+    char* buf;
+    size_t len;                 // # bytes of input in `buf`
+    size_t outlen;              // # bytes of output in `buf`
+    unsigned long long lines;   // results of summarizing transforms
+    unsigned long long sum;
+} chunk;
+
+
+// queue
+//    A bounded queue of chunk pointers that any number of threads may
+//    push to and pop from. Every slot has a sequence number saying whose
+//    turn it is: a producer may fill the slot for position `pos` when the
+//    number equals `pos`, and a consumer may empty it when the number is
+//    `pos + 1`. Threads claim positions with compare-and-swap, so nobody
+//    ever holds a lock; a thread that finds the queue full (or empty)
+//    yields the CPU and tries again.
+
+typedef struct queue_slot {
+    unsigned long seq;
+    chunk* c;
+} queue_slot;
+
+typedef struct queue {
+    queue_slot* slot;
+    unsigned long mask;         // # slots - 1 (# slots is a power of 2)
+    unsigned long head;         // next position to pop
+    unsigned long tail;         // next position to push
+} queue;
+
+// queue_init(q, n)
+//    make `q` an empty queue with room for at least `n` chunks
+static void queue_init(queue* q, size_t n) {
+    size_t cap = 1;
+    while (cap < n) {
+        cap *= 2;
+    }
+    q->slot = (queue_slot*) calloc(cap, sizeof(queue_slot));
+    assert(q->slot);
+    for (size_t i = 0; i < cap; ++i) {
+        q->slot[i].seq = i;
+    }
+    q->mask = cap - 1;
+    q->head = q->tail = 0;
+}
+
+// queue_push(q, c)
+//    add `c`, which may be NULL, to the back of `q`
+static void queue_push(queue* q, chunk* c) {
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (1) {
+        queue_slot* s = &q->slot[pos & q->mask];
+        long diff = (long) (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            // on failure, `pos` becomes the current tail
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                s->c = c;
+                __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+                return;
+            }
+        } else {
+            if (diff < 0) {
+                sched_yield();  // full
+            }
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// queue_pop(q)
+//    remove and return the chunk at the front of `q`, waiting for one
+static chunk* queue_pop(queue* q) {
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    while (1) {
+        queue_slot* s = &q->slot[pos & q->mask];
+        long diff = (long) (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                chunk* c = s->c;
+                // the slot is free for the next turn around the ring
+                __atomic_store_n(&s->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return c;
+            }
+        } else {
+            if (diff < 0) {
+                sched_yield();  // empty
+            }
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+// transforms
+//    A transform rewrites a chunk's buffer in place, setting `outlen`, and
+//    may also summarize it in `lines` and `sum`.
+
+typedef void (*transform_function)(chunk* c);
+
+static void transform_cat(chunk* c) {
+    c->outlen = c->len;
+}
+
+// The case transforms change ASCII letters only, as toupper() does in
+// the "C" locale, but without a call per character.
+static void transform_upper(chunk* c) {
+    for (size_t i = 0; i < c->len; ++i) {
+        unsigned char ch = c->buf[i];
+        c->buf[i] = (unsigned char) (ch - 'a') < 26 ? ch - ('a' - 'A') : ch;
+    }
+    c->outlen = c->len;
+}
+
+static void transform_lower(chunk* c) {
+    for (size_t i = 0; i < c->len; ++i) {
+        unsigned char ch = c->buf[i];
+        c->buf[i] = (unsigned char) (ch - 'A') < 26 ? ch + ('a' - 'A') : ch;
+    }
+    c->outlen = c->len;
+}
+
+static void transform_lines(chunk* c) {
+    c->lines = 0;
+    for (size_t i = 0; i < c->len; ++i) {
+        c->lines += c->buf[i] == '\n';
+    }
+    c->outlen = 0;
+}
+
+static void transform_sum(chunk* c) {
+    const unsigned char* buf = (const unsigned char*) c->buf;
+    c->lines = c->sum = 0;
+    for (size_t i = 0; i < c->len; ++i) {
+        c->lines += buf[i] == '\n';
+        c->sum += buf[i] * (unsigned long long) (c->pos + i + 1);
+    }
+    c->outlen = 0;
+}
+
+#define REPORT_NONE  0          // output is the transformed chunks
+#define REPORT_LINES 1          // output is the line count
+#define REPORT_SUM   2          // output is the line count, size, and sum
+
+static const struct transform {
+    const char* name;
+    transform_function f;
+    int report;
+} transforms[] = {
+    { "cat", transform_cat, REPORT_NONE },
+    { "upper", transform_upper, REPORT_NONE },
+    { "lower", transform_lower, REPORT_NONE },
+    { "lines", transform_lines, REPORT_LINES },
+    { "sum", transform_sum, REPORT_SUM }
+};
+
+
+// pipeline
+//    State shared by the pipeline's threads. Chunks go around a loop: the
+//    reader fills empty chunks from `empty` and pushes them to `work`,
+//    workers move them from `work` to `done`, and the writer returns them
+//    to `empty` once they have been written. A NULL in `work` or `done`
+//    means the thread that pushed it is finished.
+
+typedef struct pipeline {
+    const struct transform* t;
+    int nworkers;
+    size_t nchunks;             // # chunks in the loop
+    queue empty;
+    queue work;
+    queue done;
+    io61_file* outf;
+    pthread_mutex_t* io_lock;   // held around io61 calls if the reader and
+                                // the writer can't use io61 at once
+    unsigned long long lines;   // totals, kept by the writer
+    unsigned long long bytes;
+    unsigned long long sum;
+} pipeline;
+
+static void* worker_thread(void* arg) {
+    pipeline* p = (pipeline*) arg;
+    chunk* c;
+    while ((c = queue_pop(&p->work))) {
+        p->t->f(c);
+        queue_push(&p->done, c);
+    }
+    queue_push(&p->done, NULL);
+    return NULL;
+}
+
+static void* writer_thread(void* arg) {
+    pipeline* p = (pipeline*) arg;
+    // Chunks finish out of order. At most `nchunks` are in flight, so
+    // chunk `seq` can wait in `pending[seq % nchunks]` for its turn.
+    chunk** pending = (chunk**) calloc(p->nchunks, sizeof(chunk*));
+    assert(pending);
+    unsigned long long next = 0;
+    int running = p->nworkers;
+    while (running > 0) {
+        chunk* c = queue_pop(&p->done);
+        if (!c) {
+            --running;
+            continue;
+        }
+        pending[c->seq % p->nchunks] = c;
+        while ((c = pending[next % p->nchunks])) {
+            pending[next % p->nchunks] = NULL;
+            if (c->outlen > 0) {
+                if (p->io_lock) {
+                    pthread_mutex_lock(p->io_lock);
+                }
+                io61_write(p->outf, c->buf, c->outlen);
+                if (p->io_lock) {
+                    pthread_mutex_unlock(p->io_lock);
+                }
+            }
+            p->lines += c->lines;
+            p->bytes += c->len;
+            p->sum += c->sum;
+            queue_push(&p->empty, c);
+            ++next;
+        }
+    }
+    free(pending);
+    return NULL;
+}
+
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args = io61_parse_arguments(argc, argv, "j:b:x:o:");
+    size_t block_size = args.block_size ? args.block_size : 1048576;
+    const char* tname = args.transform ? args.transform : "cat";
+
+    pipeline p;
+    memset(&p, 0, sizeof(p));
+    for (size_t i = 0; i != sizeof(transforms) / sizeof(transforms[0]); ++i) {
+        if (strcmp(transforms[i].name, tname) == 0) {
+            p.t = &transforms[i];
+        }
+    }
+    if (!p.t) {
+        fprintf(stderr, "%s: unknown transform `%s`\n", argv[0], tname);
+        exit(1);
+    }
+
+    // Make the chunks: two per worker keeps every worker busy while the
+    // reader and the writer each hold one
+    p.nworkers = args.nthreads;
+    p.nchunks = 2 * p.nworkers + 2;
+    queue_init(&p.empty, p.nchunks);
+    queue_init(&p.work, p.nchunks + p.nworkers);
+    queue_init(&p.done, p.nchunks + p.nworkers);
+    chunk* chunks = (chunk*) calloc(p.nchunks, sizeof(chunk));
+    assert(chunks);
+    for (size_t i = 0; i != p.nchunks; ++i) {
+        chunks[i].buf = (char*) malloc(block_size);
+        assert(chunks[i].buf);
+        queue_push(&p.empty, &chunks[i]);
+    }
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    p.outf = io61_open_check(args.output_file, O_WRONLY | O_CREAT | O_TRUNC);
+
+    // io61_pread leaves the rest of io61 alone, so the reader and the
+    // writer can work at once. Files without a size (pipes) must be read
+    // with io61_read, which can't run alongside io61_write.
+    pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+    int use_pread = io61_filesize(inf) >= 0;
+    p.io_lock = use_pread ? NULL : &io_lock;
+
+    pthread_t writer;
+    pthread_t* workers = (pthread_t*) calloc(p.nworkers, sizeof(pthread_t));
+    assert(workers);
+    int r = pthread_create(&writer, NULL, writer_thread, &p);
+    assert(r == 0);
+    for (int i = 0; i < p.nworkers; ++i) {
+        r = pthread_create(&workers[i], NULL, worker_thread, &p);
+        assert(r == 0);
+    }
+
+    // Read
+    unsigned long long seq = 0;
+    off_t pos = 0;
+    while (1) {
+        chunk* c = queue_pop(&p.empty);
+        ssize_t amount;
+        if (use_pread) {
+            amount = io61_pread(inf, c->buf, block_size, pos);
+        } else {
+            pthread_mutex_lock(&io_lock);
+            amount = io61_read(inf, c->buf, block_size);
+            pthread_mutex_unlock(&io_lock);
+        }
+        if (amount <= 0) {
+            break;
+        }
+        c->seq = seq;
+        c->pos = pos;
+        c->len = amount;
+        c->lines = c->sum = 0;
+        queue_push(&p.work, c);
+        ++seq;
+        pos += amount;
+    }
+    for (int i = 0; i < p.nworkers; ++i) {
+        queue_push(&p.work, NULL);
+    }
+
+    for (int i = 0; i < p.nworkers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    if (p.t->report != REPORT_NONE) {
+        char line[100];
+        int len;
+        if (p.t->report == REPORT_LINES) {
+            len = snprintf(line, sizeof(line), "%llu\n", p.lines);
+        } else {
+            len = snprintf(line, sizeof(line), "%llu %llu %016llx\n",
+                           p.lines, p.bytes, p.sum);
+        }
+        io61_write(p.outf, line, len);
+    }
+
+    io61_close(inf);
+    io61_close(p.outf);
+    io61_profile_end();
+
+    for (size_t i = 0; i != p.nchunks; ++i) {
+        free(chunks[i].buf);
+    }
+    free(chunks);
+    free(workers);
+    free(p.empty.slot);
+    free(p.work.slot);
+    free(p.done.slot);
+}
@@ -22,6 +22,8 @@ static const struct message_set messages[] = {
     { 20, 10000, 10000 }
 };
 
+static int explicit_flush = 1;
+
 // Requester algorithm:
 //    for (i = 0; i < request_batch; ++i) {
 //        send request of size request_size;
@@ -73,8 +75,10 @@ void requester(io61_file* outf, io61_file* inf) {
             ssize_t r = io61_write(outf, buf, m->request_size);
             assert((size_t) r == m->request_size);
         }
-        int x = io61_flush(outf);
-        assert(x >= 0);
+        if (explicit_flush) {
+            int x = io61_flush(outf);
+            assert(x >= 0);
+        }
         for (int i = 0; i < m->request_batch; ++i) {
             ssize_t r = io61_read(inf, buf, m->response_size);
             assert((size_t) r == m->response_size);
@@ -104,8 +108,10 @@ void responder(io61_file* outf, io61_file* inf) {
             assert((size_t) r == m->request_size);
             r = io61_write(outf, buf, m->response_size);
             assert((size_t) r == m->response_size);
-            int x = io61_flush(outf);
-            assert(x >= 0);
+            if (explicit_flush) {
+                int x = io61_flush(outf);
+                assert(x >= 0);
+            }
         }
     }
 
@@ -115,14 +121,38 @@ void responder(io61_file* outf, io61_file* inf) {
     exit(0);
 }
 
+// Usage: ./pipeexchange61 [-s] [-a]
+//    Exchanges batches of requests and responses between two processes
+//    over pipes, or with -s, over socket pairs. With -a, neither side calls
+//    io61_flush and the library must flush on its own (stdio can't).
+
 int main(int argc, char* argv[]) {
-    (void) argc, (void) argv;
+    int use_sockets = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "sa")) != -1) {
+        if (opt == 's') {
+            use_sockets = 1;
+        } else if (opt == 'a') {
+            explicit_flush = 0;
+        } else {
+            fprintf(stderr, "Usage: %s [-s] [-a]\n", argv[0]);
+            exit(1);
+        }
+    }
 
-    // create a connected socket pair for communicating between processes
+    // create connected pipes or socket pairs for communicating between
+    // processes
     int request_fds[2], response_fds[2];
-    int r1 = pipe(request_fds), r2 = pipe(response_fds);
+    int r1, r2;
+    if (use_sockets) {
+        r1 = socketpair(AF_UNIX, SOCK_STREAM, 0, request_fds);
+        r2 = socketpair(AF_UNIX, SOCK_STREAM, 0, response_fds);
+    } else {
+        r1 = pipe(request_fds);
+        r2 = pipe(response_fds);
+    }
     if (r1 < 0 || r2 < 0) {
-        perror("pipe");
+        perror(use_sockets ? "socketpair" : "pipe");
         exit(1);
     }
 
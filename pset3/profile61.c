@@ -6,8 +6,9 @@
 // profile61.c
 //    The profile functions measure how much time and memory are used
 //    by your code. The io61_profile_end() function prints a simple
-//    report to standard error. The io61_parse_arguments() function
-//    parses common arguments into a structure.
+//    report, with io61's I/O counters, to standard error. The
+//    io61_parse_arguments() function parses common arguments into a
+//    structure.
 
 static struct timeval tv_begin;
 
@@ -31,12 +32,20 @@ void io61_profile_end(void) {
     timeradd(&usage.ru_utime, &cusage.ru_utime, &usage.ru_utime);
     timeradd(&usage.ru_stime, &cusage.ru_stime, &usage.ru_stime);
 
-    char buf[1000];
-    int len = sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
+    // io61's own counters, if it keeps any, go in an "io61" member
+    size_t statsz = io61_stats_json(NULL, 0);
+    char* buf = (char*) malloc(statsz + 1000);
+    assert(buf);
+    int len = sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld",
                       tv_end.tv_sec, (long) tv_end.tv_usec,
                       usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
                       usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
                       usage.ru_maxrss + cusage.ru_maxrss);
+    if (statsz > 0) {
+        len += sprintf(buf + len, ", \"io61\":");
+        len += io61_stats_json(buf + len, statsz + 1);
+    }
+    len += sprintf(buf + len, "}\n");
 
     // Print the report to file descriptor 100 if it's available. Our
     // `check.pl` test harness uses this file descriptor.
@@ -47,6 +56,7 @@ void io61_profile_end(void) {
     }
     ssize_t nwritten = write(fd, buf, len);
     assert(nwritten == len);
+    free(buf);
 }
 
 
@@ -57,6 +67,13 @@ io61_arguments io61_parse_arguments(int argc, char* argv[], const char* opts) {
     args.stride = 1024;
     args.output_file = args.input_file = NULL;
     args.input_files = NULL;
+    args.zero_copy = 0;
+    args.direct = 0;
+    args.nthreads = 1;
+    args.transform = NULL;
+    args.decompress = 0;
+    args.checksum = 0;
+    args.memory = 0;
 
     int arg;
     char* endptr;
@@ -91,6 +108,45 @@ io61_arguments io61_parse_arguments(int argc, char* argv[], const char* opts) {
         case 'o':
             args.output_file = optarg;
             break;
+        case 'z':
+            args.zero_copy = 1;
+            break;
+        case 'D':
+            args.direct = 1;
+            break;
+        case 'j':
+            args.nthreads = (int) strtol(optarg, &endptr, 0);
+            if (args.nthreads <= 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
+        case 'x':
+            args.transform = optarg;
+            break;
+        case 'd':
+            args.decompress = 1;
+            break;
+        case 'k':
+            args.checksum = 1;
+            break;
+        case 'S':
+            args.memory = (size_t) strtoul(optarg, &endptr, 0);
+            switch (*endptr) {
+            case 'G': case 'g':
+                args.memory <<= 10;
+                // fallthrough
+            case 'M': case 'm':
+                args.memory <<= 10;
+                // fallthrough
+            case 'K': case 'k':
+                args.memory <<= 10;
+                ++endptr;
+                break;
+            }
+            if (args.memory == 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
         case '#':
             break;
         default:
@@ -124,6 +180,27 @@ io61_arguments io61_parse_arguments(int argc, char* argv[], const char* opts) {
     if (strchr(opts, 'o')) {
         fprintf(stderr, " [-o OUTFILE]");
     }
+    if (strchr(opts, 'z')) {
+        fprintf(stderr, " [-z]");
+    }
+    if (strchr(opts, 'D')) {
+        fprintf(stderr, " [-D]");
+    }
+    if (strchr(opts, 'j')) {
+        fprintf(stderr, " [-j NTHREADS]");
+    }
+    if (strchr(opts, 'x')) {
+        fprintf(stderr, " [-x TRANSFORM]");
+    }
+    if (strchr(opts, 'k')) {
+        fprintf(stderr, " [-k]");
+    }
+    if (strchr(opts, 'd')) {
+        fprintf(stderr, " [-d]");
+    }
+    if (strchr(opts, 'S')) {
+        fprintf(stderr, " [-S MEMORY]");
+    }
     if (strchr(opts, '#')) {
         fprintf(stderr, " [FILE...]\n");
     } else {
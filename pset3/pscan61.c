@@ -0,0 +1,95 @@
+#include "io61.h"
+#include <pthread.h>
+
+// Usage: ./pscan61 [-j NTHREADS] [-b BLOCKSIZE] [-s SIZE] [-o OUTFILE] [FILE]
+//    Scans the first SIZE bytes of FILE (default: all of it) with NTHREADS
+//    threads at once, each reading its own part of the file in blocks with
+//    io61_pread. All threads share one io61_file. Writes the number of
+//    lines and bytes scanned, and a checksum that depends on the position
+//    of every byte, to OUTFILE. Default NTHREADS is 1 and default
+//    BLOCKSIZE is 4096.
+
+typedef struct scan {
+    pthread_t thread;
+    io61_file* f;
+    off_t start;                // scan [start, end)
+    off_t end;
+    size_t block_size;
+    unsigned long long lines;   // results
+    unsigned long long bytes;
+    unsigned long long sum;
+} scan;
+
+static void* scan_thread(void* arg) {
+    scan* s = (scan*) arg;
+    unsigned char* buf = (unsigned char*) malloc(s->block_size);
+    off_t pos = s->start;
+    while (pos < s->end) {
+        size_t n = s->block_size;
+        if ((off_t) n > s->end - pos) {
+            n = s->end - pos;
+        }
+        ssize_t amount = io61_pread(s->f, (char*) buf, n, pos);
+        if (amount <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < amount; ++i) {
+            s->lines += buf[i] == '\n';
+            s->sum += buf[i] * (unsigned long long) (pos + i + 1);
+        }
+        s->bytes += amount;
+        pos += amount;
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args = io61_parse_arguments(argc, argv, "j:b:s:o:");
+    size_t block_size = args.block_size ? args.block_size : 4096;
+    int nthreads = args.nthreads;
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    off_t size = io61_filesize(inf);
+    if (args.input_size != (size_t) -1) {
+        size = args.input_size;
+    }
+    if (size < 0) {
+        fprintf(stderr, "%s: can't scan a file of unknown size (use -s)\n",
+                args.input_file ? args.input_file : "<stdin>");
+        exit(1);
+    }
+
+    // Scan in parallel, one contiguous part per thread
+    scan* scans = (scan*) calloc(nthreads, sizeof(scan));
+    for (int i = 0; i < nthreads; ++i) {
+        scans[i].f = inf;
+        scans[i].start = size * i / nthreads;
+        scans[i].end = size * (i + 1) / nthreads;
+        scans[i].block_size = block_size;
+        int r = pthread_create(&scans[i].thread, NULL, scan_thread, &scans[i]);
+        assert(r == 0);
+    }
+    unsigned long long lines = 0, bytes = 0, sum = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(scans[i].thread, NULL);
+        lines += scans[i].lines;
+        bytes += scans[i].bytes;
+        sum += scans[i].sum;
+    }
+
+    char line[100];
+    int len = snprintf(line, sizeof(line), "%llu %llu %016llx\n",
+                       lines, bytes, sum);
+    io61_write(outf, line, len);
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+    free(scans);
+}
@@ -1,22 +1,28 @@
 #include "io61.h"
 
-// Usage: ./scatter61 [-b BLOCKSIZE] [FILE1 FILE2...]
+// Usage: ./scatter61 [-b BLOCKSIZE] [-z] [FILE1 FILE2...]
 //    Copies the standard input to the FILEs, alternating between FILEs
 //    with every block. (I.e., write a block to FILE1, then
 //    a block to FILE2, etc.) This is a "scatter" I/O pattern: one
-//    input file is scattered into many output files.
-//    Default BLOCKSIZE is 1.
+//    input file is scattered into many output files. Each round's
+//    blocks are read from standard input with one io61_readv.
+//    Default BLOCKSIZE is 1. With -z, copies each block with io61_copy.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args = io61_parse_arguments(argc, argv, "b:#");
+    io61_arguments args = io61_parse_arguments(argc, argv, "b:z#");
     size_t block_size = args.block_size ? args.block_size : 1;
     // Note that we use `args.input_files` for OUTPUT files.
 
-    // Allocate buffer, open files
-    char* buf = (char*) malloc(block_size);
-
+    // Allocate buffers, open files
     int nfiles = args.n_input_files;
+    char* buf = (char*) malloc(block_size * nfiles);
+    struct iovec* iov = (struct iovec*) calloc(nfiles, sizeof(struct iovec));
+    for (int i = 0; i < nfiles; ++i) {
+        iov[i].iov_base = buf + i * block_size;
+        iov[i].iov_len = block_size;
+    }
+
     io61_profile_begin();
     io61_file* inf = io61_fdopen(STDIN_FILENO, O_RDONLY);
     io61_file** outfs = (io61_file**) calloc(nfiles, sizeof(io61_file*));
@@ -27,14 +33,27 @@ int main(int argc, char* argv[]) {
 
     // Copy file data
     int whichf = 0;
-    while (1) {
-        ssize_t amount = io61_read(inf, buf, block_size);
-        if (amount <= 0) {
+    while (args.zero_copy) {
+        if (io61_copy(outfs[whichf], inf, block_size) <= 0) {
             break;
         }
-        io61_write(outfs[whichf], buf, amount);
         whichf = (whichf + 1) % nfiles;
     }
+    while (!args.zero_copy) {
+        // read a block for every file at once, then hand them out
+        ssize_t amount = io61_readv(inf, iov, nfiles);
+        if (amount <= 0) {
+            break;
+        }
+        for (int i = 0; amount > 0; ++i) {
+            size_t n = block_size;
+            if ((size_t) amount < n) {
+                n = amount;
+            }
+            io61_write(outfs[i], buf + i * block_size, n);
+            amount -= n;
+        }
+    }
 
     io61_close(inf);
     for (int i = 0; i < nfiles; ++i) {
@@ -42,5 +61,6 @@ int main(int argc, char* argv[]) {
     }
     io61_profile_end();
     free(outfs);
+    free(iov);
     free(buf);
 }
@@ -0,0 +1,358 @@
+#include "io61.h"
+#include <pthread.h>
+#include <stdint.h>
+
+// Usage: ./sort61 [-S MEMORY] [-j NTHREADS] [-o OUTFILE] [FILE]
+//    Sorts the lines of FILE bytewise (like `LC_ALL=C sort -s`) into
+//    OUTFILE, holding at most MEMORY bytes of lines at once. The input is
+//    read a chunk at a time, up to the memory budget; NTHREADS threads
+//    sort each chunk with a parallel merge sort, and every chunk but a
+//    lone one is spilled as a sorted run to a temporary file in $TMPDIR
+//    (or /tmp). The runs are then merged with io61_merge, in several
+//    passes if there are more than IO61_MERGE_MAX of them. A last line
+//    without a newline gets one. MEMORY may end in K, M or G. Default
+//    MEMORY is 256M and default NTHREADS is 1. The peak resident set size
+//    appears as "maxrss" (in KiB) in io61_profile_end's report.
+
+
+// record
+//    A line in a chunk. `key` holds the line's first 8 bytes, big-endian
+//    and zero-padded, so most comparisons never look at the line itself.
+
+typedef struct record {
+    uint64_t key;
+    const char* line;           // the line, followed by its newline
+    size_t len;                 // length of `line` without the newline
+} record;
+
+// record_key(line, len)
+//    return the sort key for `line`
+static uint64_t record_key(const char* line, size_t len) {
+    uint64_t key = 0;
+    for (size_t i = 0; i != 8; ++i) {
+        key = (key << 8) | (i < len ? (unsigned char) line[i] : 0);
+    }
+    return key;
+}
+
+// record_less(a, b)
+//    return true if `a`'s line sorts before `b`'s
+static inline int record_less(const record* a, const record* b) {
+    if (a->key != b->key) {
+        return a->key < b->key;
+    }
+    size_t n = a->len < b->len ? a->len : b->len;
+    if (n > 8) {
+        int c = memcmp(a->line + 8, b->line + 8, n - 8);
+        if (c != 0) {
+            return c < 0;
+        }
+    }
+    return a->len < b->len;
+}
+
+
+// sorting
+//    A stable merge sort. Merging two sorted neighbors copies the shorter
+//    one aside, so sorting `n` records needs scratch space for only n/2.
+
+// merge_neighbors(r, tmp, a, b, c)
+//    merge sorted records [a, b) and [b, c) of `r`, using `tmp` for the
+//    shorter of the two
+static void merge_neighbors(record* r, record* tmp, size_t a, size_t b,
+                            size_t c) {
+    if (a == b || b == c || !record_less(&r[b], &r[b - 1])) {
+        return;
+    }
+    if (b - a <= c - b) {
+        // forwards, taking the left record on ties
+        size_t nl = b - a, i = 0, j = b, k = a;
+        memcpy(tmp, &r[a], nl * sizeof(record));
+        while (i != nl && j != c) {
+            r[k++] = record_less(&r[j], &tmp[i]) ? r[j++] : tmp[i++];
+        }
+        memcpy(&r[k], &tmp[i], (nl - i) * sizeof(record));
+    } else {
+        // backwards, taking the right record on ties
+        size_t nr = c - b, i = b, j = nr, k = c;
+        memcpy(tmp, &r[b], nr * sizeof(record));
+        while (i != a && j != 0) {
+            r[--k] = record_less(&tmp[j - 1], &r[i - 1]) ? r[--i] : tmp[--j];
+        }
+        memcpy(&r[a], tmp, j * sizeof(record));
+    }
+}
+
+// sort_records(r, tmp, n)
+//    sort the `n` records in `r`, using `tmp` (room for n/2 records)
+static void sort_records(record* r, record* tmp, size_t n) {
+    if (n <= 16) {
+        for (size_t i = 1; i < n; ++i) {
+            record x = r[i];
+            size_t j = i;
+            while (j != 0 && record_less(&x, &r[j - 1])) {
+                r[j] = r[j - 1];
+                --j;
+            }
+            r[j] = x;
+        }
+        return;
+    }
+    size_t h = n / 2;
+    sort_records(r, tmp, h);
+    sort_records(r + h, tmp, n - h);
+    merge_neighbors(r, tmp, 0, h, n);
+}
+
+// sort_task
+//    One thread's share of sorting a chunk: it sorts, or merges with its
+//    right neighbor, the records in [a, c). Its scratch space starts at
+//    record a/2 of the chunk's, so tasks working at once never share any.
+
+typedef struct sort_task {
+    record* r;
+    record* tmp;
+    size_t a, b, c;             // merge: [a, b) and [b, c); sort: b == c
+    pthread_t thread;
+} sort_task;
+
+static void* sort_thread(void* arg) {
+    sort_task* t = (sort_task*) arg;
+    record* tmp = t->tmp + t->a / 2;
+    if (t->b == t->c) {
+        sort_records(t->r + t->a, tmp, t->c - t->a);
+    } else {
+        merge_neighbors(t->r, tmp, t->a, t->b, t->c);
+    }
+    return NULL;
+}
+
+// run_tasks(tasks, n)
+//    run `n` sort tasks, all but the first on threads of their own, and
+//    wait for them to finish
+static void run_tasks(sort_task* tasks, int n) {
+    for (int i = 1; i < n; ++i) {
+        int r = pthread_create(&tasks[i].thread, NULL, sort_thread, &tasks[i]);
+        assert(r == 0);
+    }
+    sort_thread(&tasks[0]);
+    for (int i = 1; i < n; ++i) {
+        pthread_join(tasks[i].thread, NULL);
+    }
+}
+
+// parallel_sort(r, tmp, n, nthreads)
+//    sort the `n` records in `r` on `nthreads` threads: each sorts a
+//    slice, then neighboring slices are merged in pairs, in parallel,
+//    until one is left
+static void parallel_sort(record* r, record* tmp, size_t n, int nthreads) {
+    if ((size_t) nthreads > n / 1024 + 1) {
+        nthreads = n / 1024 + 1;
+    }
+    sort_task* tasks = (sort_task*) calloc(nthreads, sizeof(sort_task));
+    size_t* bound = (size_t*) calloc(nthreads + 1, sizeof(size_t));
+    assert(tasks && bound);
+    for (int i = 0; i <= nthreads; ++i) {
+        bound[i] = n * i / nthreads;
+    }
+    for (int i = 0; i != nthreads; ++i) {
+        sort_task* t = &tasks[i];
+        t->r = r;
+        t->tmp = tmp;
+        t->a = bound[i];
+        t->b = t->c = bound[i + 1];
+    }
+    run_tasks(tasks, nthreads);
+
+    for (int nslices = nthreads; nslices > 1; nslices = (nslices + 1) / 2) {
+        int ntasks = 0;
+        for (int i = 0; i + 1 < nslices; i += 2) {
+            sort_task* t = &tasks[ntasks++];
+            t->a = bound[i];
+            t->b = bound[i + 1];
+            t->c = bound[i + 2];
+        }
+        run_tasks(tasks, ntasks);
+        for (int i = 0; i <= nslices; i += 2) {
+            bound[i / 2] = bound[i];
+        }
+        bound[(nslices + 1) / 2] = n;
+    }
+    free(tasks);
+    free(bound);
+}
+
+
+// chunks
+//    A chunk lives in one arena of MEMORY bytes. Records grow up from the
+//    bottom, with scratch space for sorting after them, and line data
+//    grows down from the top. A line that doesn't fit waits, in the input
+//    file's buffer, for the next chunk.
+
+typedef struct chunk {
+    char* arena;
+    size_t arena_sz;
+    record* rec;
+    size_t n;                   // # records
+    const char* pending;        // line read but not yet stored, or NULL
+    size_t pending_len;
+} chunk;
+
+// chunk_fill(c, inf)
+//    fill chunk `c` with the next lines of `inf`. Returns the number of
+//    lines read, which is 0 at end of file.
+static size_t chunk_fill(chunk* c, io61_file* inf) {
+    c->rec = (record*) c->arena;
+    c->n = 0;
+    char* data = c->arena + c->arena_sz;
+    while (1) {
+        const char* line = c->pending;
+        size_t linelen = c->pending_len;
+        if (!line) {
+            int r = io61_readline(inf, &line, &linelen);
+            if (r < 0) {
+                perror("sort61");
+                exit(1);
+            } else if (r == 0) {
+                break;
+            }
+        }
+        size_t len = linelen - (line[linelen - 1] == '\n');
+
+        // records and their scratch space must stay below the line data
+        size_t nrec = c->n + 1 + (c->n + 1) / 2;
+        if ((size_t) (data - c->arena) < len + 1
+            || (size_t) (data - len - 1 - c->arena) / sizeof(record) < nrec) {
+            if (c->n == 0) {
+                fprintf(stderr, "sort61: line longer than memory budget\n");
+                exit(1);
+            }
+            c->pending = line;
+            c->pending_len = linelen;
+            break;
+        }
+        c->pending = NULL;
+        data -= len + 1;
+        memcpy(data, line, len);
+        data[len] = '\n';
+        record* rec = &c->rec[c->n++];
+        rec->key = record_key(data, len);
+        rec->line = data;
+        rec->len = len;
+    }
+    return c->n;
+}
+
+// chunk_write(c, outf)
+//    write chunk `c`'s lines to `outf` in record order
+static void chunk_write(chunk* c, io61_file* outf) {
+    for (size_t i = 0; i != c->n; ++i) {
+        ssize_t len = c->rec[i].len + 1;
+        if (io61_write(outf, c->rec[i].line, len) != len) {
+            perror("sort61");
+            exit(1);
+        }
+    }
+}
+
+
+// runs
+//    Sorted runs are spilled to temporary files. A run is unlinked as
+//    soon as it is opened for merging, so it goes away when closed.
+
+// run_create(name)
+//    create a temporary file for a run, store its name in `*name`, and
+//    return it open for writing
+static io61_file* run_create(char** name) {
+    const char* dir = getenv("TMPDIR");
+    if (!dir || !*dir) {
+        dir = "/tmp";
+    }
+    *name = (char*) malloc(strlen(dir) + 20);
+    assert(*name);
+    sprintf(*name, "%s/sort61.XXXXXX", dir);
+    int fd = mkstemp(*name);
+    if (fd < 0) {
+        perror(*name);
+        exit(1);
+    }
+    return io61_fdopen(fd, O_WRONLY);
+}
+
+// merge_runs(outf, names, n)
+//    merge the `n` runs named in `names` into `outf`, deleting them
+static void merge_runs(io61_file* outf, char** names, int n) {
+    io61_file* infs[IO61_MERGE_MAX];
+    for (int i = 0; i != n; ++i) {
+        infs[i] = io61_open_check(names[i], O_RDONLY);
+        unlink(names[i]);
+        free(names[i]);
+    }
+    if (io61_merge(outf, infs, n) < 0) {
+        perror("sort61");
+        exit(1);
+    }
+    for (int i = 0; i != n; ++i) {
+        io61_close(infs[i]);
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args = io61_parse_arguments(argc, argv, "S:j:o:");
+    chunk c;
+    c.arena_sz = args.memory ? args.memory : (size_t) 256 << 20;
+    c.arena = (char*) malloc(c.arena_sz);
+    if (!c.arena) {
+        fprintf(stderr, "sort61: can't allocate %zu bytes\n", c.arena_sz);
+        exit(1);
+    }
+    c.pending = NULL;
+    c.pending_len = 0;
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Sort the input a chunk at a time, spilling all but a lone chunk
+    char** names = NULL;
+    int nruns = 0;
+    while (chunk_fill(&c, inf) != 0) {
+        parallel_sort(c.rec, c.rec + c.n, c.n, args.nthreads);
+        if (nruns == 0 && !c.pending) {
+            chunk_write(&c, outf);
+            break;
+        }
+        names = (char**) realloc(names, (nruns + 1) * sizeof(char*));
+        assert(names);
+        io61_file* runf = run_create(&names[nruns]);
+        chunk_write(&c, runf);
+        io61_close(runf);
+        ++nruns;
+    }
+    io61_close(inf);
+    free(c.arena);
+
+    // Merge groups of runs into longer runs until one merge will do
+    while (nruns > IO61_MERGE_MAX) {
+        int nmerged = 0;
+        for (int i = 0; i < nruns; i += IO61_MERGE_MAX) {
+            int n = nruns - i < IO61_MERGE_MAX ? nruns - i : IO61_MERGE_MAX;
+            char* name;
+            io61_file* runf = run_create(&name);
+            merge_runs(runf, &names[i], n);
+            io61_close(runf);
+            names[nmerged++] = name;
+        }
+        nruns = nmerged;
+    }
+    if (nruns > 0) {
+        merge_runs(outf, names, nruns);
+    }
+
+    io61_close(outf);
+    io61_profile_end();
+    free(names);
+}
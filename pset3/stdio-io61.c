@@ -12,19 +12,25 @@
 //    Data structure for io61 file wrappers.
 
 struct io61_file {
+    io61_cursor c;      // always empty
     FILE* f;
+    char* line;         // io61_readline() buffer
+    size_t line_sz;
 };
 
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
-//    either O_RDONLY for a read-only file or O_WRONLY for a
-//    write-only file. You need not support read/write files.
+//    either O_RDONLY for a read-only file, O_WRONLY for a
+//    write-only file, or O_RDWR for a read/write file.
 
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
     io61_file* f = (io61_file*) malloc(sizeof(io61_file));
-    f->f = fdopen(fd, mode == O_RDONLY ? "r" : "w");
+    memset(&f->c, 0, sizeof(f->c));
+    f->f = fdopen(fd, mode == O_RDONLY ? "r" : mode == O_WRONLY ? "w" : "r+");
+    f->line = NULL;
+    f->line_sz = 0;
     return f;
 }
 
@@ -35,16 +41,18 @@ io61_file* io61_fdopen(int fd, int mode) {
 int io61_close(io61_file* f) {
     io61_flush(f);
     int r = fclose(f->f);
+    free(f->line);
     free(f);
     return r;
 }
 
 
-// io61_readc(f)
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+//    (which is -1) on error or end-of-file. io61_readc() calls this for
+//    every character, since the cursor is always empty.
 
-int io61_readc(io61_file* f) {
+int io61_readc_slow(io61_file* f) {
     return fgetc(f->f);
 }
 
@@ -66,11 +74,12 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
-// io61_writec(f)
+// io61_writec_slow(f, ch)
 //    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+//    -1 on error. io61_writec() calls this for every character, since
+//    the cursor is always empty.
 
-int io61_writec(io61_file* f, int ch) {
+int io61_writec_slow(io61_file* f, int ch) {
     return fputc(ch, f->f);
 }
 
@@ -90,6 +99,175 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_readv(f, iov, iovcnt)
+//    Read into the `iovcnt` buffers in `iov`, filling each in turn.
+//    Returns the number of characters read, which is short at end of
+//    file, or -1 if an error occurred before any characters were read.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        size_t n = fread(iov[i].iov_base, 1, iov[i].iov_len, f->f);
+        nread += n;
+        if (n != iov[i].iov_len) {
+            break;
+        }
+    }
+    if (nread != 0 || !ferror(f->f)) {
+        return (ssize_t) nread;
+    } else {
+        return (ssize_t) -1;
+    }
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers in `iov` in order. Returns the number of
+//    characters written, or -1 if an error occurred before any characters
+//    were written.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        size_t n = fwrite(iov[i].iov_base, 1, iov[i].iov_len, f->f);
+        nwritten += n;
+        if (n != iov[i].iov_len) {
+            break;
+        }
+    }
+    if (nwritten != 0 || !ferror(f->f)) {
+        return (ssize_t) nwritten;
+    } else {
+        return (ssize_t) -1;
+    }
+}
+
+
+// io61_copy(outf, inf, sz)
+//    Copy up to `sz` characters from `inf` to `outf`, stopping early at end
+//    of file. Returns the number of characters copied, or -1 if an error
+//    occurred before any characters were copied.
+
+ssize_t io61_copy(io61_file* outf, io61_file* inf, size_t sz) {
+    char buf[BUFSIZ];
+    size_t ncopied = 0;
+    while (ncopied != sz) {
+        size_t n = sz - ncopied < BUFSIZ ? sz - ncopied : BUFSIZ;
+        n = fread(buf, 1, n, inf->f);
+        if (n == 0 || fwrite(buf, 1, n, outf->f) != n) {
+            break;
+        }
+        ncopied += n;
+    }
+    if (ncopied != 0 || sz == 0 || !(ferror(inf->f) || ferror(outf->f))) {
+        return (ssize_t) ncopied;
+    } else {
+        return (ssize_t) -1;
+    }
+}
+
+
+// io61_pread(f, buf, sz, off)
+//    Read up to `sz` characters from read-only file `f`, starting at
+//    position `off`, into `buf`, without changing the file position.
+//    Returns the number of characters read, or -1 if an error occurred
+//    before any characters were read. Threads take turns with the stream
+//    lock.
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    ssize_t r = -1;
+    flockfile(f->f);
+    off_t pos = ftello(f->f);
+    if (pos != -1 && fseeko(f->f, off, SEEK_SET) == 0) {
+        r = fread(buf, 1, sz, f->f);
+        if (r == 0 && sz != 0 && ferror(f->f)) {
+            r = -1;
+        }
+        fseeko(f->f, pos, SEEK_SET);
+    }
+    funlockfile(f->f);
+    return r;
+}
+
+
+// io61_readline(f, linep, lenp)
+//    Read a line from `f`, up to and including its newline, and set
+//    `*linep` to point at it and `*lenp` to its length. Returns 1 if a
+//    line was read, 0 at end of file, or -1 on error. The line stays
+//    valid until `f` is next read from or closed.
+
+int io61_readline(io61_file* f, const char** linep, size_t* lenp) {
+    ssize_t n = getline(&f->line, &f->line_sz, f->f);
+    if (n == -1) {
+        return ferror(f->f) ? -1 : 0;
+    }
+    *linep = f->line;
+    *lenp = n;
+    return 1;
+}
+
+// io61_merge(outf, inf, k)
+//    Merge the lines of the `k` files in `inf`, each sorted bytewise, into
+//    `outf`, and return the number of characters written, or -1 on error.
+//    Lines are compared without their newlines, and equal lines are
+//    written in the order of the files holding them. A last line without
+//    a newline gets one. `k` must be between 1 and IO61_MERGE_MAX. This
+//    version scans every file's current line to find the next to write.
+
+ssize_t io61_merge(io61_file* outf, io61_file** inf, int k) {
+    if (k < 1 || k > IO61_MERGE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    const char* line[IO61_MERGE_MAX];
+    size_t len[IO61_MERGE_MAX];
+    for (int i = 0; i < k; ++i) {
+        int r = io61_readline(inf[i], &line[i], &len[i]);
+        if (r < 0) {
+            return -1;
+        } else if (r == 0) {
+            line[i] = NULL;
+        }
+    }
+
+    size_t nwritten = 0;
+    while (1) {
+        int best = -1;
+        size_t bestkey = 0;
+        for (int i = 0; i < k; ++i) {
+            if (!line[i]) {
+                continue;
+            }
+            size_t key = len[i] - (line[i][len[i] - 1] == '\n');
+            if (best >= 0) {
+                int c = memcmp(line[i], line[best], key < bestkey ? key : bestkey);
+                if (c > 0 || (c == 0 && key >= bestkey)) {
+                    continue;
+                }
+            }
+            best = i;
+            bestkey = key;
+        }
+        if (best < 0) {
+            return nwritten;
+        }
+
+        if (io61_write(outf, line[best], len[best]) != (ssize_t) len[best]
+            || (bestkey == len[best] && io61_writec(outf, '\n') == -1)) {
+            return -1;
+        }
+        nwritten += bestkey + 1;
+        int r = io61_readline(inf[best], &line[best], &len[best]);
+        if (r < 0) {
+            return -1;
+        } else if (r == 0) {
+            line[best] = NULL;
+        }
+    }
+}
+
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
@@ -120,7 +298,9 @@ int io61_seek(io61_file* f, off_t pos) {
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename) {
-        fd = open(filename, mode, 0666);
+        // no O_DIRECT or compression here
+        fd = open(filename, mode & ~(IO61_DIRECT | IO61_COMPRESS
+                                     | IO61_CHECKSUM), 0666);
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
@@ -156,3 +336,14 @@ off_t io61_filesize(io61_file* f) {
 int io61_eof(io61_file* f) {
     return feof(f->f);
 }
+
+
+// io61_stats_json(buf, sz)
+//    Write a JSON object with I/O counters to `buf`, the way snprintf()
+//    would, and return its length. This version keeps no counters.
+
+size_t io61_stats_json(char* buf, size_t sz) {
+    if (sz > 0)
+        buf[0] = '\0';
+    return 0;
+}
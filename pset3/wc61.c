@@ -0,0 +1,42 @@
+#include "io61.h"
+
+// Usage: ./wc61 [-o OUTFILE] [-D] [FILE]
+//    Counts the lines, words, and bytes in FILE, reading it a line at a
+//    time with io61_readline, and writes the counts to OUTFILE like
+//    `wc` does. With -D, opens FILE with IO61_DIRECT.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args = io61_parse_arguments(argc, argv, "o:D");
+
+    io61_profile_begin();
+    int direct = args.direct ? IO61_DIRECT : 0;
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY | direct);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    unsigned long long lines = 0, words = 0, bytes = 0;
+    const char* line;
+    size_t len;
+    while (io61_readline(inf, &line, &len) > 0) {
+        // a word starts at a non-space after a space; the line before
+        // ended in a newline, so a line starts after a space
+        int prev_space = 1;
+        for (size_t i = 0; i != len; ++i) {
+            unsigned char ch = line[i];
+            int space = ch == ' ' || (unsigned char) (ch - '\t') <= '\r' - '\t';
+            words += prev_space & !space;
+            prev_space = space;
+        }
+        lines += len > 0 && line[len - 1] == '\n';
+        bytes += len;
+    }
+
+    char buf[100];
+    int n = snprintf(buf, sizeof(buf), "%llu %llu %llu\n", lines, words, bytes);
+    io61_write(outf, buf, n);
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}